@@ -22,17 +22,51 @@
 
 enum class commit_cached_state {
   PURGED,
+  LOADING,
   FILLED,
 };
 
+/* class of each line in the output of git show, computed at loading */
+enum class line_class : unsigned char {
+  HEADER,		/* commit, Author, Date, ... */
+  MESSAGE,
+  FILE_HEADER,		/* diff --git, index, ---, +++, ... */
+  HUNK_HEADER,		/* @@ ... @@ */
+  ADDED,
+  REMOVED,
+  CONTEXT,
+};
+
+#define line_class_bit(cls) (1U << static_cast<unsigned int>(cls))
+#define LINE_CLASS_ALL ((1U << 7) - 1)
+
+/* diffs over the budgets of a load are generated again with cheaper options */
+enum class diff_level : unsigned char {
+  FULL,
+  NO_RENAMES,		/* --no-renames --diff-algorithm=myers */
+  STAT,			/* --stat --summary, without patches */
+};
+
+struct display_line;
+
 struct commit_cached {
   commit_cached_state state;
+  /* users of the text, a pinned text is never evicted */
+  int pins;
 
   char *text;
-  unsigned int text_size;
+  size_t text_size;
+  /* text is mmap()ed from an unlinked temporary file instead of the heap */
+  bool spilled;
+  /* the diff of the text, reduced if it was over the budgets */
+  diff_level level;
 
   char **lines;
+  line_class *line_classes;
   int nr_lines, lines_size;
+
+  /* cells of lines shown on the screen, built lazily */
+  struct display_line **display;
 };
 
 struct commit {
@@ -40,6 +74,9 @@ struct commit {
 
   int head_line;
 
+  /* position in the output of git log, 0 for HEAD. -1 while unknown */
+  int log_idx;
+
   /*
    * caution:
    * prev means previous commit of the commit object,
@@ -51,12 +88,24 @@ struct commit {
   struct commit *size_next;
   bool size_order_initialized;
 
-  char *commit_id, *summary;
+  char commit_id[41];
+
+  /*
+   * metadata from the record of git log. author is an index of the author
+   * table, -1 until the record is read (e.g. root found by git rev-list)
+   */
+  int author;
+  unsigned int date;		/* committer date */
+  unsigned char nr_parents;
 
-  char **file_list;
-  int nr_file_list, file_list_size;
+  /* the full diff is requested, loaded without the budgets */
+  bool full_diff;
+  /* dropped from the history by a rewrite, freed once it is unpinned */
+  bool gone;
 
-  char **commit_log;
-  int commit_log_lines;
+  /* derived from the text, freed when the text is purged */
+  char *summary;
+  int *file_list;		/* ids of the path table */
+  int nr_file_list;
 };
 
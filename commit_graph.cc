@@ -0,0 +1,416 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "commit_graph.hh"
+
+#define GRAPH_SIGNATURE 0x43475048 /* "CGPH" */
+#define GRAPH_HEADER_SIZE 8
+#define GRAPH_CHUNK_LOOKUP_WIDTH 12
+
+#define GRAPH_CHUNKID_OIDFANOUT 0x4f494446 /* "OIDF" */
+#define GRAPH_CHUNKID_OIDLOOKUP 0x4f49444c /* "OIDL" */
+#define GRAPH_CHUNKID_DATA 0x43444154 /* "CDAT" */
+#define GRAPH_CHUNKID_BLOOMINDEXES 0x42494458 /* "BIDX" */
+#define GRAPH_CHUNKID_BLOOMDATA 0x42444154 /* "BDAT" */
+
+/* hash version, number of hashes and bits per entry */
+#define BLOOM_DATA_HEADER_SIZE 12
+
+#define HASH_LEN 20
+#define GRAPH_DATA_WIDTH (HASH_LEN + 16)
+
+#define MAX_GRAPH_FILES 64
+
+struct graph_file {
+  const unsigned char *data;
+  size_t size;
+
+  /* number of commits in the files before this one in the chain */
+  uint32_t base;
+  uint32_t nr_commits;
+
+  const unsigned char *fanout, *oids, *commit_data;
+
+  /* changed-path Bloom filters, NULL if the file doesn't have them */
+  const unsigned char *bloom_indexes, *bloom_data;
+  uint64_t bloom_data_size;
+  uint32_t bloom_version, bloom_nr_hashes;
+};
+
+static struct graph_file graph_files[MAX_GRAPH_FILES];
+static int nr_graph_files;
+
+static uint32_t get_be32(const unsigned char *p)
+{
+  return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16
+    | (uint32_t)p[2] << 8 | (uint32_t)p[3];
+}
+
+static uint64_t get_be64(const unsigned char *p)
+{
+  return (uint64_t)get_be32(p) << 32 | get_be32(p + 4);
+}
+
+static bool parse_graph_file(struct graph_file *g)
+{
+  const unsigned char *d = g->data;
+
+  if (g->size < GRAPH_HEADER_SIZE || get_be32(d) != GRAPH_SIGNATURE)
+    return false;
+
+  if (d[4] != 1 /* version */ || d[5] != 1 /* SHA-1 */)
+    return false;
+
+  int nr_chunks = d[6];
+  if (g->size < GRAPH_HEADER_SIZE
+      + (size_t)(nr_chunks + 1) * GRAPH_CHUNK_LOOKUP_WIDTH)
+    return false;
+
+  const unsigned char *table = d + GRAPH_HEADER_SIZE;
+  uint64_t bloom_indexes_size = 0;
+
+  for (int i = 0; i < nr_chunks; i++) {
+    const unsigned char *ent = table + i * GRAPH_CHUNK_LOOKUP_WIDTH;
+    uint32_t id = get_be32(ent);
+    uint64_t offset = get_be64(ent + 4);
+    /* chunks are in order, the terminating entry has the end */
+    uint64_t next = get_be64(ent + GRAPH_CHUNK_LOOKUP_WIDTH + 4);
+
+    if (g->size <= offset || next < offset || g->size < next)
+      return false;
+
+    switch (id) {
+    case GRAPH_CHUNKID_OIDFANOUT:
+      g->fanout = d + offset;
+      break;
+    case GRAPH_CHUNKID_OIDLOOKUP:
+      g->oids = d + offset;
+      break;
+    case GRAPH_CHUNKID_DATA:
+      g->commit_data = d + offset;
+      break;
+    case GRAPH_CHUNKID_BLOOMINDEXES:
+      g->bloom_indexes = d + offset;
+      bloom_indexes_size = next - offset;
+      break;
+    case GRAPH_CHUNKID_BLOOMDATA:
+      g->bloom_data = d + offset;
+      g->bloom_data_size = next - offset;
+      break;
+    default:
+      /* other chunks are not used */
+      break;
+    }
+  }
+
+  if (!g->fanout || !g->oids || !g->commit_data)
+    return false;
+
+  g->nr_commits = get_be32(g->fanout + 255 * 4);
+
+  const unsigned char *end = d + g->size;
+  if (end < g->oids + (size_t)g->nr_commits * HASH_LEN
+      || end < g->commit_data + (size_t)g->nr_commits * GRAPH_DATA_WIDTH)
+    return false;
+
+  /* broken or unknown Bloom filters are just ignored */
+  if (g->bloom_indexes && g->bloom_data
+      && bloom_indexes_size == (uint64_t)g->nr_commits * 4
+      && BLOOM_DATA_HEADER_SIZE <= g->bloom_data_size) {
+    g->bloom_version = get_be32(g->bloom_data);
+    g->bloom_nr_hashes = get_be32(g->bloom_data + 4);
+  }
+
+  if (g->bloom_version != 1 && g->bloom_version != 2) {
+    g->bloom_indexes = g->bloom_data = NULL;
+    g->bloom_version = 0;
+  }
+
+  return true;
+}
+
+static bool load_graph_file(const char *path)
+{
+  if (nr_graph_files == MAX_GRAPH_FILES)
+    return false;
+
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return false;
+
+  struct stat st;
+  if (fstat(fd, &st) < 0 || !st.st_size) {
+    close(fd);
+    return false;
+  }
+
+  void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED)
+    return false;
+
+  struct graph_file *g = &graph_files[nr_graph_files];
+  memset(g, 0, sizeof(*g));
+  g->data = static_cast<const unsigned char *>(data);
+  g->size = st.st_size;
+
+  if (!parse_graph_file(g)) {
+    munmap(data, st.st_size);
+    return false;
+  }
+
+  if (nr_graph_files) {
+    struct graph_file *prev = &graph_files[nr_graph_files - 1];
+    g->base = prev->base + prev->nr_commits;
+  }
+
+  nr_graph_files++;
+  return true;
+}
+
+static void unload_graph_files(void)
+{
+  for (int i = 0; i < nr_graph_files; i++)
+    munmap(const_cast<unsigned char *>(graph_files[i].data),
+	   graph_files[i].size);
+
+  nr_graph_files = 0;
+}
+
+bool commit_graph_load(const char *info_dir)
+{
+  char path[PATH_MAX];
+
+  unload_graph_files();
+
+  /* git prefers a single commit-graph file to a chain */
+  snprintf(path, PATH_MAX, "%s/commit-graph", info_dir);
+  if (load_graph_file(path))
+    return true;
+
+  snprintf(path, PATH_MAX, "%s/commit-graphs/commit-graph-chain", info_dir);
+  FILE *chain = fopen(path, "r");
+  if (!chain)
+    return false;
+
+  /* the chain lists graph files from the base */
+  char hash[128];
+  while (fscanf(chain, "%127s", hash) == 1) {
+    snprintf(path, PATH_MAX, "%s/commit-graphs/graph-%s.graph",
+	     info_dir, hash);
+    if (!load_graph_file(path)) {
+      unload_graph_files();
+      break;
+    }
+  }
+
+  fclose(chain);
+  return !!nr_graph_files;
+}
+
+bool commit_graph_loaded(void)
+{
+  return !!nr_graph_files;
+}
+
+uint32_t commit_graph_nr_commits(void)
+{
+  if (!nr_graph_files)
+    return 0;
+
+  struct graph_file *last = &graph_files[nr_graph_files - 1];
+  return last->base + last->nr_commits;
+}
+
+static int hex_to_oid(const char *hex, unsigned char *oid)
+{
+  for (int i = 0; i < HASH_LEN; i++) {
+    unsigned int byte;
+
+    if (sscanf(hex + i * 2, "%2x", &byte) != 1)
+      return -1;
+
+    oid[i] = byte;
+  }
+
+  return 0;
+}
+
+bool commit_graph_lookup(const char *commit_id, uint32_t *pos)
+{
+  unsigned char oid[HASH_LEN];
+
+  if (hex_to_oid(commit_id, oid))
+    return false;
+
+  for (int i = 0; i < nr_graph_files; i++) {
+    struct graph_file *g = &graph_files[i];
+
+    uint32_t lo = oid[0] ? get_be32(g->fanout + (oid[0] - 1) * 4) : 0;
+    uint32_t hi = get_be32(g->fanout + oid[0] * 4);
+
+    while (lo < hi) {
+      uint32_t mid = lo + (hi - lo) / 2;
+      int cmp = memcmp(oid, g->oids + (size_t)mid * HASH_LEN, HASH_LEN);
+
+      if (!cmp) {
+	*pos = g->base + mid;
+	return true;
+      }
+
+      if (cmp < 0)
+	hi = mid;
+      else
+	lo = mid + 1;
+    }
+  }
+
+  return false;
+}
+
+static struct graph_file *graph_file_of(uint32_t *pos)
+{
+  for (int i = nr_graph_files - 1; 0 <= i; i--) {
+    if (graph_files[i].base <= *pos) {
+      *pos -= graph_files[i].base;
+      return &graph_files[i];
+    }
+  }
+
+  return NULL;
+}
+
+uint32_t commit_graph_generation(uint32_t pos)
+{
+  struct graph_file *g = graph_file_of(&pos);
+  if (!g || g->nr_commits <= pos)
+    return 0;
+
+  /* higher 30 bits of the first word after the tree and parents */
+  const unsigned char *ent = g->commit_data + (size_t)pos * GRAPH_DATA_WIDTH;
+  return get_be32(ent + HASH_LEN + 8) >> 2;
+}
+
+/*
+ * changed-path Bloom filters: each commit has a filter of the paths changed
+ * from its first parent, with their leading directories. a path is looked up
+ * with k bits from two murmur3 hashes. version 1 filters are built from
+ * bytes sign extended like chars of git.
+ */
+#define BLOOM_SEED0 0x293ae76f
+#define BLOOM_SEED1 0x7e646e2c
+
+static uint32_t rotl32(uint32_t x, int r)
+{
+  return x << r | x >> (32 - r);
+}
+
+static uint32_t murmur3(uint32_t seed, const char *data, size_t len,
+			bool sign_extend)
+{
+  const uint32_t c1 = 0xcc9e2d51, c2 = 0x1b873593;
+  uint32_t h = seed;
+
+#define byte_at(i) (sign_extend ? (uint32_t)(signed char)data[i]	\
+		    : (uint32_t)(unsigned char)data[i])
+
+  size_t nr_blocks = len / 4;
+  for (size_t i = 0; i < nr_blocks; i++) {
+    uint32_t k = byte_at(i * 4) | byte_at(i * 4 + 1) << 8
+      | byte_at(i * 4 + 2) << 16 | byte_at(i * 4 + 3) << 24;
+
+    k *= c1;
+    k = rotl32(k, 15);
+    k *= c2;
+
+    h ^= k;
+    h = rotl32(h, 13);
+    h = h * 5 + 0xe6546b64;
+  }
+
+  size_t tail = nr_blocks * 4;
+  uint32_t k = 0;
+  switch (len & 3) {
+  case 3:
+    k ^= byte_at(tail + 2) << 16;
+    /* fall through */
+  case 2:
+    k ^= byte_at(tail + 1) << 8;
+    /* fall through */
+  case 1:
+    k ^= byte_at(tail);
+    k *= c1;
+    k = rotl32(k, 15);
+    k *= c2;
+    h ^= k;
+  }
+
+#undef byte_at
+
+  h ^= len;
+  h ^= h >> 16;
+  h *= 0x85ebca6b;
+  h ^= h >> 13;
+  h *= 0xc2b2ae35;
+  h ^= h >> 16;
+
+  return h;
+}
+
+/* hashes of the path being looked up, for versions 1 and 2 */
+static uint32_t bloom_hashes[2][2];
+static bool bloom_path_set;
+
+bool commit_graph_has_bloom(void)
+{
+  for (int i = 0; i < nr_graph_files; i++) {
+    if (graph_files[i].bloom_version)
+      return true;
+  }
+
+  return false;
+}
+
+void commit_graph_set_bloom_path(const char *path)
+{
+  bloom_path_set = !!path;
+  if (!path)
+    return;
+
+  size_t len = strlen(path);
+  for (int v = 0; v < 2; v++) {
+    bloom_hashes[v][0] = murmur3(BLOOM_SEED0, path, len, !v);
+    bloom_hashes[v][1] = murmur3(BLOOM_SEED1, path, len, !v);
+  }
+}
+
+bool commit_graph_bloom_maybe(uint32_t pos)
+{
+  struct graph_file *g = graph_file_of(&pos);
+  if (!bloom_path_set || !g || g->nr_commits <= pos || !g->bloom_version)
+    return true;
+
+  uint32_t begin = pos ? get_be32(g->bloom_indexes + (pos - 1) * 4) : 0;
+  uint32_t end = get_be32(g->bloom_indexes + pos * 4);
+  if (end <= begin
+      || g->bloom_data_size - BLOOM_DATA_HEADER_SIZE < (uint64_t)end)
+    return true;		/* no filter is computed */
+
+  const unsigned char *filter = g->bloom_data + BLOOM_DATA_HEADER_SIZE + begin;
+  uint64_t nr_bits = (uint64_t)(end - begin) * 8;
+  uint32_t *hashes = bloom_hashes[g->bloom_version - 1];
+
+  for (uint32_t i = 0; i < g->bloom_nr_hashes; i++) {
+    uint64_t bit = (uint32_t)(hashes[0] + i * hashes[1]) % nr_bits;
+
+    if (!(filter[bit / 8] & (1 << (bit % 8))))
+      return false;
+  }
+
+  return true;
+}
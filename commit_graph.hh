@@ -0,0 +1,43 @@
+/*
+ * glg - a specialized pager for git log
+ *
+ * Copyright (C) 2012 - 2016 Hitoshi Mitake <mitake.hitoshi@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+/*
+ * reader of git's commit-graph files (objects/info/commit-graph, or a split
+ * chain under objects/info/commit-graphs). only SHA-1 graphs are supported.
+ */
+
+bool commit_graph_load(const char *info_dir);
+bool commit_graph_loaded(void);
+
+uint32_t commit_graph_nr_commits(void);
+bool commit_graph_lookup(const char *commit_id, uint32_t *pos);
+/* topological level, 1 for root commits */
+uint32_t commit_graph_generation(uint32_t pos);
+
+/* changed-path Bloom filters (git commit-graph write --changed-paths) */
+bool commit_graph_has_bloom(void);
+/* path relative to the top directory without a trailing '/', NULL to unset */
+void commit_graph_set_bloom_path(const char *path);
+/* false if the commit at pos definitely doesn't change the path */
+bool commit_graph_bloom_maybe(uint32_t pos);
@@ -1,9 +1,140 @@
 #include <unistd.h>
 
 #include "util.hh"
+#include "git.hh"
+
+#define MAX_GIT_ARGS 256
+
+static const char *log_args[MAX_GIT_ARGS];
+static int nr_log_args;
+
+static const char *pathspecs[MAX_GIT_ARGS];
+static int nr_pathspecs;
+
+/* has_rev: false means the default, HEAD */
+static bool has_rev, limited;
+
+/*
+ * a record per commit of the history: ID, committer date, parents and
+ * author, separated with 0x1f
+ */
+#define LOG_RECORD_FORMAT "--format=%H%x1f%ct%x1f%P%x1f%an <%ae>"
+
+void git_add_revision(const char *rev)
+{
+  if (nr_log_args == MAX_GIT_ARGS)
+    die("too many revisions and options\n");
+
+  log_args[nr_log_args++] = rev;
+  has_rev = true;
+
+  if (strstr(rev, "..") || rev[0] == '^')
+    limited = true;
+}
+
+void git_add_log_option(const char *opt)
+{
+  if (nr_log_args == MAX_GIT_ARGS)
+    die("too many revisions and options\n");
+
+  log_args[nr_log_args++] = opt;
+
+  if (!strcmp(opt, "--all"))
+    has_rev = true;
+  else if (!strncmp(opt, "--since", 7) || !strncmp(opt, "--until", 7))
+    limited = true;
+}
+
+void git_add_pathspec(const char *path)
+{
+  if (nr_pathspecs == MAX_GIT_ARGS)
+    die("too many pathspecs\n");
+
+  pathspecs[nr_pathspecs++] = path;
+  limited = true;
+}
+
+bool git_history_limited(void)
+{
+  return limited;
+}
+
+bool git_has_log_args(void)
+{
+  return nr_log_args || nr_pathspecs;
+}
+
+/*
+ * git_args_signature(): revisions, log options and pathspecs separated by
+ * spaces, a history is identified with it across sessions
+ */
+void git_args_signature(char *buf, size_t size)
+{
+  size_t len = 0;
+
+  buf[0] = '\0';
+  for (int i = 0; i < nr_log_args + nr_pathspecs; i++) {
+    const char *arg = i < nr_log_args ?
+      log_args[i] : pathspecs[i - nr_log_args];
+
+    int ret = snprintf(buf + len, size - len, "%s%s ",
+		       i < nr_log_args ? "" : "-- ", arg);
+    if (ret < 0 || size - len <= (size_t)ret)
+      break;
+
+    len += ret;
+  }
+
+  /* newlines would break the line oriented session file */
+  for (char *p = buf; *p; p++) {
+    if (*p == '\n')
+      *p = ' ';
+  }
+}
+
+/*
+ * build_argv(): NULL terminated head, followed by revisions and log options
+ * if with_log_args, and pathspecs if with_pathspecs. free() the result.
+ */
+static char **build_argv(const char *const head[], bool with_log_args,
+			 bool with_pathspecs)
+{
+  int nr_head = 0;
+  while (head[nr_head])
+    nr_head++;
+
+  const char **argv = static_cast<const char **>(calloc(nr_head + 1 + MAX_GIT_ARGS * 2 + 2, sizeof(char *)));
+  if (!argv)
+    die("memory allocation failed\n");
+
+  int i = 0;
+  for (int j = 0; j < nr_head; j++)
+    argv[i++] = head[j];
+
+  if (with_log_args) {
+    for (int j = 0; j < nr_log_args; j++)
+      argv[i++] = log_args[j];
+
+    /* git rev-list doesn't default to HEAD */
+    if (!has_rev)
+      argv[i++] = "HEAD";
+  }
+
+  if (with_pathspecs && nr_pathspecs) {
+    argv[i++] = "--";
+    for (int j = 0; j < nr_pathspecs; j++)
+      argv[i++] = pathspecs[j];
+  }
+
+  argv[i] = NULL;
+  return const_cast<char **>(argv);
+}
 
 void launch_git_log(int inputfd)
 {
+  const char *head[] = { "git", "log", LOG_RECORD_FORMAT, NULL };
+  char **argv = build_argv(head, true, true);
+
   int pipefds[2];
   if (pipe(pipefds))
     die("pipe() failed\n");
@@ -17,8 +148,8 @@ void launch_git_log(int inputfd)
     dup(pipefds[1]);
     close(pipefds[0]);
 
-    if (execlp("git", "git", "log", "--pretty=format:%H", NULL))
-      die("execlp() failed\n");
+    if (execvp("git", argv))
+      die("execvp() failed\n");
 
     break;
   case -1:
@@ -30,5 +161,200 @@ void launch_git_log(int inputfd)
     dup(pipefds[0]); /* connect git log to stdin */
     break;
   }
+
+  free(argv);
 }
 
+
+/*
+ * launch_git_log_summary(): start a git log which emits one line per commit,
+ * fields separated with 0x1f: commit ID, author, date and summary.
+ * *fd is set for reading the output.
+ */
+pid_t launch_git_log_summary(int *fd)
+{
+  const char *head[] = {
+    "git", "log", "--date=short",
+    "--pretty=format:%H%x1f%an%x1f%ad%x1f%s", NULL
+  };
+  char **argv = build_argv(head, true, true);
+
+  int pipefds[2];
+  if (pipe(pipefds))
+    die("pipe() failed\n");
+
+  pid_t pid = fork();
+  switch (pid) {
+  case 0:
+    setsid();
+
+    close(1);
+    dup(pipefds[1]);
+    close(pipefds[0]);
+
+    if (execvp("git", argv))
+      die("execvp() failed\n");
+
+    break;
+  case -1:
+    die("fork failed\n");
+    break;
+  default:
+    close(pipefds[1]);
+    break;
+  }
+
+  free(argv);
+  *fd = pipefds[0];
+  return pid;
+}
+
+/*
+ * launch_git_argv(): start git with NULL terminated argv (argv[0] is "git"),
+ * *fd is set to a fd for reading the output. return pid of the git process.
+ */
+pid_t launch_git_argv(char *const argv[], int *fd)
+{
+  int pipefds[2];
+  if (pipe(pipefds))
+    die("pipe() failed\n");
+
+  pid_t pid = fork();
+  switch (pid) {
+  case 0:
+    close(1);
+    dup(pipefds[1]);
+    close(pipefds[0]);
+    if (execvp("git", argv))
+      die("execvp() failed\n");
+
+    break;
+
+  case -1:
+    die("fork() failed\n");
+    break;
+
+  default:
+    close(pipefds[1]);
+    break;
+  }
+
+  *fd = pipefds[0];
+  return pid;
+}
+
+/*
+ * launch_git_show(): start git show of commit_id, limited by pathspecs.
+ * no_renames skips rename detection and costly diff algorithms from the
+ * config, stat omits patches.
+ */
+pid_t launch_git_show(const char *commit_id, bool no_renames, bool stat,
+		      int *fd)
+{
+  const char *head[8] = { "git", "show", };
+  int i = 2;
+
+  if (no_renames) {
+    head[i++] = "--no-renames";
+    head[i++] = "--diff-algorithm=myers";
+  }
+  if (stat) {
+    head[i++] = "--stat";
+    head[i++] = "--summary";
+  }
+  head[i++] = commit_id;
+  head[i] = NULL;
+
+  char **argv = build_argv(head, false, true);
+
+  pid_t pid = launch_git_argv(argv, fd);
+  free(argv);
+
+  return pid;
+}
+
+/* launch_git_rev_list(): start git rev-list opt over the history of glg */
+pid_t launch_git_rev_list(const char *opt, int *fd)
+{
+  const char *head[] = { "git", "rev-list", opt, NULL };
+  char **argv = build_argv(head, true, true);
+
+  pid_t pid = launch_git_argv(argv, fd);
+  free(argv);
+
+  return pid;
+}
+
+/* messages of commits in the order of git log, each preceded by \x1e */
+pid_t launch_git_log_messages(int *fd)
+{
+  const char *head[] = { "git", "log", "--format=%x1e%B", NULL };
+  char **argv = build_argv(head, true, true);
+
+  pid_t pid = launch_git_argv(argv, fd);
+  free(argv);
+
+  return pid;
+}
+
+/* commits touching path (relative to the top directory), following renames */
+pid_t launch_git_log_follow(const char *path, int *fd)
+{
+  const char *head[] = { "git", "log", "--follow", LOG_RECORD_FORMAT, NULL };
+  char **argv = build_argv(head, true, false);
+
+  int i = 0;
+  while (argv[i])
+    i++;
+
+  char *top = static_cast<char *>(malloc(strlen(path) + 7));
+  if (!top)
+    die("memory allocation failed\n");
+  sprintf(top, ":(top)%s", path);
+
+  argv[i++] = const_cast<char *>("--");
+  argv[i++] = top;
+  argv[i] = NULL;
+
+  pid_t pid = launch_git_argv(argv, fd);
+  free(top);
+  free(argv);
+
+  return pid;
+}
+
+/* records of git log like launch_git_log(), read from *fd */
+pid_t launch_git_log_records(int *fd)
+{
+  const char *head[] = { "git", "log", LOG_RECORD_FORMAT, NULL };
+  char **argv = build_argv(head, true, true);
+
+  pid_t pid = launch_git_argv(argv, fd);
+  free(argv);
+
+  return pid;
+}
+
+/*
+ * launch_git_log_grep(): IDs of the commits of git log whose messages match
+ * regex, a basic regex compared without case like the search of glg
+ */
+pid_t launch_git_log_grep(const char *regex, int *fd)
+{
+  char *grep = static_cast<char *>(malloc(strlen(regex) + 8));
+  if (!grep)
+    die("memory allocation failed\n");
+  sprintf(grep, "--grep=%s", regex);
+
+  const char *head[] = {
+    "git", "log", "--format=%H", "--basic-regexp", "--regexp-ignore-case",
+    grep, NULL
+  };
+  char **argv = build_argv(head, true, true);
+
+  pid_t pid = launch_git_argv(argv, fd);
+  free(argv);
+  free(grep);
+
+  return pid;
+}
@@ -1,4 +1,26 @@
 #pragma once
 
-void launch_git_log(int inputfd);
+#include <sys/types.h>
+
+/*
+ * arguments from the command line of glg. revisions and log options are
+ * passed to git log and git rev-list, pathspecs also limit git show.
+ */
+void git_add_revision(const char *rev);
+void git_add_log_option(const char *opt);
+void git_add_pathspec(const char *path);
+/* true when the history is limited by ranges, dates or paths */
+bool git_history_limited(void);
+bool git_has_log_args(void);
+void git_args_signature(char *buf, size_t size);
 
+void launch_git_log(int inputfd);
+pid_t launch_git_log_summary(int *fd);
+pid_t launch_git_show(const char *commit_id, bool no_renames, bool stat,
+		      int *fd);
+pid_t launch_git_rev_list(const char *opt, int *fd);
+pid_t launch_git_log_messages(int *fd);
+pid_t launch_git_log_follow(const char *path, int *fd);
+pid_t launch_git_log_records(int *fd);
+pid_t launch_git_log_grep(const char *regex, int *fd);
+pid_t launch_git_argv(char *const argv[], int *fd);
@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 
 #include <unistd.h>
 #include <sys/types.h>
@@ -13,13 +14,24 @@
 #include <sys/wait.h>
 #include <limits.h>
 #include <sys/signalfd.h>
+#include <sys/mman.h>
 #include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <wchar.h>
+#include <locale.h>
+#include <langinfo.h>
 
 #include <regex.h>
+#define NCURSES_WIDECHAR 1
 #include <ncurses.h>
 
 #include <string>
-#include <regex>
+#include <vector>
+#include <deque>
+#include <map>
+#include <unordered_map>
+#include <algorithm>
 
 using namespace std;
 
@@ -28,8 +40,14 @@ using namespace std;
 #include "util.hh"
 #include "git.hh"
 #include "commit.hh"
+#include "commit_graph.hh"
+#include "ticket.hh"
+#include "watch.hh"
+#include "sched.hh"
+#include "pressure.hh"
 
 static char *debug_file_path;
+static const char *ticket_pattern = DEFAULT_TICKET_PATTERN;
 
 extern int errno;
 
@@ -73,6 +91,29 @@ static int ret_nl_index(char *s)
 }
 
 static int stdin_fd = 0, tty_fd;
+
+/*
+ * file history: commits touching a file, streamed from git log --follow into
+ * a chain of their own. h, l and searches walk the chain of the file while
+ * the chain of the entire history is saved.
+ */
+struct commit_chain {
+  struct commit *head, *tail, *root, *current;
+  struct commit *range_begin, *range_end;
+
+  int fd;
+  struct log_buf *buf;
+  bool read_end;
+  int nr_read_commits;
+
+  long nr_history;
+  bool nr_history_estimated;
+};
+
+static struct commit_chain entire_history;
+/* path of the followed file, NULL while walking the entire history */
+static const char *file_history_path;
+
 static unsigned int row, col;
 
 #define LINES_INIT_SIZE 128
@@ -87,26 +128,12 @@ enum class main_loop_state {
   LAUNCH_GIT_COMMAND,
   READ_BRANCHNAME_FOR_CHECKOUT,
   SHOW_CHANGED_FILES,
+  SHOW_COMMIT_LIST,
+  INPUT_COMMIT_FILTER,
   HELP,
 };
 static main_loop_state state = main_loop_state::DEFAULT;
 
-enum class long_run {
-  DEFAULT,
-  RUNNING,
-  STOPPED,
-};
-static long_run state_long_run = long_run::DEFAULT;
-/*
- * long_run_command(): called in the main loop when state_long_run == true
- * return 1 when the iteration ends. return 0 for continuing.
- */
-static int (*long_run_command)(void);
-/*
- * long_run_command_compl(): called after completion of long running command
- */
-static void (*long_run_command_compl)(bool stopped);
-
 enum class search_type {
   REGEX,
   FTS,
@@ -117,14 +144,14 @@ static search_type current_search_type;
 static char *bottom_message;
 static unsigned int bottom_message_size = BOTTOM_MESSAGE_INIT_SIZE;
 
-#define MATCH_ARRAY_INIT_SIZE 32
-static regmatch_t *match_array;
-static unsigned int match_array_size = MATCH_ARRAY_INIT_SIZE;
+/* the bottom message shows the status of the query by update_query_bm() */
+static bool bm_shows_query;
 
 #define bmprintf(fmt, arg...)				\
   do {							\
     snprintf(bottom_message, bottom_message_size,	\
 	     fmt, ##arg);				\
+    bm_shows_query = false;				\
   } while (0)
 
 static FILE* debug_file;
@@ -149,12 +176,6 @@ static void update_row_col(void)
     bottom_message = static_cast<char *>(xrealloc(bottom_message, bottom_message_size));
   }
 
-  if (match_array_size < col) {
-    match_array_size = col;
-    match_array = static_cast<regmatch_t *>(xrealloc(match_array,
-						     match_array_size * sizeof(regmatch_t)));
-  }
-
   resizeterm(size.ws_row, size.ws_col);
 }
 
@@ -171,6 +192,11 @@ static void init_tty(void)
   if (tty_fd < 0)
     die("open()ing /dev/tty");
 
+  /* texts from git are UTF-8 even if the locale doesn't say so */
+  setlocale(LC_ALL, "");
+  if (strcmp(nl_langinfo(CODESET), "UTF-8"))
+    setlocale(LC_CTYPE, "C.UTF-8");
+
   initscr();
 
   cbreak();
@@ -191,38 +217,379 @@ static void init_tty(void)
 
 #define raw_get_cached(c) (&c->cached) /* simply get pointer */
 
-int contain_visible_char(char *buf)
+/*
+ * memory usage per category. everything on the heap is bounded by alloc_lim
+ * together, spilled texts are bounded by SPILL_LIM. texts and the metadata
+ * derived from them (lines, file lists, summaries, display cells) are evicted
+ * together.
+ */
+enum class mem_category {
+  TEXT,
+  SPILLED_TEXT,
+  LINES,
+  FILE_LIST,
+  PATHS,
+  SUMMARY,
+  NODE,
+  LOAD_BUF,
+  COMMIT_LIST,
+  DISPLAY,
+  NR_CATEGORIES,
+};
+
+static const char *mem_category_names[] = {
+  "text", "spilled", "lines", "files", "paths", "summary", "node", "load",
+  "list", "display",
+};
+
+/* updated atomically, texts are loaded and evicted by several threads */
+static size_t mem_usage[(int)mem_category::NR_CATEGORIES];
+
+#define mem_add(cat, size)						\
+  __atomic_add_fetch(&mem_usage[(int)(cat)], (size), __ATOMIC_RELAXED)
+#define mem_sub(cat, size)						\
+  __atomic_sub_fetch(&mem_usage[(int)(cat)], (size), __ATOMIC_RELAXED)
+#define mem_get(cat) __atomic_load_n(&mem_usage[(int)(cat)], __ATOMIC_RELAXED)
+
+/*
+ * the budget of the heap: a half of the memory available to glg (the limit
+ * of its cgroup or MemAvailable), ALLOC_LIM_DEFAULT if it isn't known. it is
+ * lowered while the kernel reports memory pressure.
+ */
+#define ALLOC_LIM_DEFAULT ((size_t)1 << 30)
+#define ALLOC_LIM_MIN ((size_t)32 << 20)
+
+/* the budget is restored after this period without pressure */
+#define PRESSURE_RECOVERY_MS 10000
+
+static size_t alloc_lim = ALLOC_LIM_DEFAULT, alloc_lim_initial;
+
+/* mem_heap_usage(): usage counted for alloc_lim */
+static size_t mem_heap_usage(void)
+{
+  size_t sum = ticket_index_usage();
+
+  for (int i = 0; i < (int)mem_category::NR_CATEGORIES; i++) {
+    if (i != (int)mem_category::SPILLED_TEXT)
+      sum += mem_get(i);
+  }
+
+  return sum;
+}
+
+static void debug_print_mem_usage(const char *when)
+{
+  if (!debug_file)
+    return;
+
+  debug_printf("mem (%s):", when);
+  for (int i = 0; i < (int)mem_category::NR_CATEGORIES; i++)
+    debug_printf(" %s=%zu", mem_category_names[i], mem_get(i));
+  debug_printf(" tickets=%zu heap=%zu lim=%zu\n", ticket_index_usage(),
+	       mem_heap_usage(), alloc_lim);
+  fflush(debug_file);
+}
+
+/* lines_usage(): size of lines and line_classes of cached */
+#define lines_usage(cached)					\
+  ((size_t)(cached)->lines_size * (sizeof(char *) + sizeof(line_class)))
+
+/* line_len(): length of a line without '\n', which can be NUL for a while */
+static int line_len(struct commit_cached *cached, int i)
+{
+  char *line = cached->lines[i];
+
+  if (i + 1 < cached->nr_lines)
+    return cached->lines[i + 1] - line - 1;
+
+  char *end = line, *text_end = cached->text + cached->text_size;
+  while (end < text_end && *end != '\n' && *end != '\0')
+    end++;
+
+  return end - line;
+}
+
+/*
+ * display cache: lines of a text are converted to runs of cells with
+ * attributes when they are shown first. redraws blit the runs, widths of
+ * multibyte characters are decided once. the cache is dropped with the text.
+ */
+struct display_line {
+  cchar_t *cells;
+  /* byte offset and column where each cell starts, nr_cells + 1 entries */
+  int *offsets, *columns;
+  int nr_cells;
+};
+
+#define TAB_WIDTH 8
+
+static size_t display_line_usage(struct display_line *d)
+{
+  return sizeof(*d) + d->nr_cells * sizeof(cchar_t)
+    + (d->nr_cells + 1) * 2 * sizeof(int);
+}
+
+/* free_display(): called with cache_lock held, or for a pinned text */
+static void free_display(struct commit_cached *cached)
+{
+  if (!cached->display)
+    return;
+
+  for (int i = 0; i < cached->nr_lines; i++) {
+    struct display_line *d = cached->display[i];
+    if (!d)
+      continue;
+
+    mem_sub(mem_category::DISPLAY, display_line_usage(d));
+    free(d->cells);
+    free(d->offsets);
+    free(d->columns);
+    free(d);
+  }
+
+  mem_sub(mem_category::DISPLAY,
+	  cached->nr_lines * sizeof(struct display_line *));
+  free(cached->display);
+  cached->display = NULL;
+}
+
+static short line_color_pair(char first_char)
+{
+  switch (first_char) {
+  case '+':
+    return COLORING_PLUS;
+  case '-':
+    return COLORING_MINUS;
+  case '@':
+    return COLORING_ATMARK;
+  case 'c':
+    return COLORING_COMMIT;
+  default:
+    return 0;
+  }
+}
+
+static struct display_line *display_line_build(struct commit_cached *cached,
+					       int i)
+{
+  const char *line = cached->lines[i];
+  int len = line_len(cached, i), column = 0;
+  short pair = line_color_pair(line[0]);
+
+  vector<cchar_t> cells;
+  vector<int> offsets, columns;
+
+  auto push = [&](wchar_t wc, int width, int offset) {
+    wchar_t wcs[2] = { wc, L'\0' };
+    cchar_t cell;
+
+    setcchar(&cell, wcs, A_NORMAL, pair, NULL);
+    cells.push_back(cell);
+    offsets.push_back(offset);
+    columns.push_back(column);
+    column += width;
+  };
+
+  mbstate_t state;
+  memset(&state, 0, sizeof(state));
+
+  for (int offset = 0; offset < len; ) {
+    wchar_t wc;
+    size_t n = mbrtowc(&wc, line + offset, len - offset, &state);
+
+    if (n == (size_t)-1 || n == (size_t)-2 || !n) {
+      /* broken sequences and NULs are shown byte by byte */
+      memset(&state, 0, sizeof(state));
+      push(0xfffd, 1, offset++);
+      continue;
+    }
+
+    if (wc == L'\t') {
+      do
+	push(L' ', 1, offset);
+      while (column % TAB_WIDTH);
+    } else if (wc < 0x20 || wc == 0x7f) {
+      /* like addch(), e.g. ^M */
+      push(L'^', 1, offset);
+      push(wc ^ 0x40, 1, offset);
+    } else {
+      int width = wcwidth(wc);
+
+      if (width < 0)
+	push(0xfffd, 1, offset);
+      else if (width)
+	push(wc, width, offset);
+      else if (!cells.empty()) {
+	/* combining characters share the cell of the base character */
+	wchar_t wcs[CCHARW_MAX + 1];
+	attr_t attr;
+	short cell_pair;
+
+	getcchar(&cells.back(), wcs, &attr, &cell_pair, NULL);
+	size_t nr_wcs = wcslen(wcs);
+	if (nr_wcs < CCHARW_MAX) {
+	  wcs[nr_wcs] = wc;
+	  wcs[nr_wcs + 1] = L'\0';
+	  setcchar(&cells.back(), wcs, attr, cell_pair, NULL);
+	}
+      }
+    }
+
+    offset += n;
+  }
+
+  offsets.push_back(len);
+  columns.push_back(column);
+
+  struct display_line *d =
+    static_cast<struct display_line *>(xalloc(sizeof(*d)));
+  d->nr_cells = cells.size();
+  d->cells = static_cast<cchar_t *>(xalloc(max((size_t)1, cells.size())
+					   * sizeof(cchar_t)));
+  memcpy(d->cells, cells.data(), cells.size() * sizeof(cchar_t));
+  d->offsets = static_cast<int *>(xalloc(offsets.size() * sizeof(int)));
+  memcpy(d->offsets, offsets.data(), offsets.size() * sizeof(int));
+  d->columns = static_cast<int *>(xalloc(columns.size() * sizeof(int)));
+  memcpy(d->columns, columns.data(), columns.size() * sizeof(int));
+
+  mem_add(mem_category::DISPLAY, display_line_usage(d));
+  return d;
+}
+
+/* display_line_get(): the cells of line i of a pinned text */
+static struct display_line *display_line_get(struct commit_cached *cached,
+					     int i)
+{
+  if (!cached->display) {
+    cached->display = static_cast<struct display_line **>(xalloc(cached->nr_lines * sizeof(struct display_line *)));
+    mem_add(mem_category::DISPLAY,
+	    cached->nr_lines * sizeof(struct display_line *));
+  }
+
+  if (!cached->display[i])
+    cached->display[i] = display_line_build(cached, i);
+
+  return cached->display[i];
+}
+
+/* display_fit(): the number of cells of d which fit in width columns */
+static int display_fit(struct display_line *d, int width)
 {
-  int len = strlen(buf);
+  return upper_bound(d->columns, d->columns + d->nr_cells + 1, width)
+    - d->columns - 1;
+}
 
-  for (int i = 0; i < len; i++)
+/* contain_visible_char(): index of the first visible char of a line, or -1 */
+int contain_visible_char(char *buf)
+{
+  /* texts aren't NUL terminated */
+  for (int i = 0; buf[i] != '\n' && buf[i] != '\0'; i++)
     if (buf[i] != ' ') return i;
 
   return -1;
 }
 
+static void classify_lines(struct commit_cached *cached)
+{
+  line_class *classes = static_cast<line_class *>(xalloc(cached->lines_size * sizeof(line_class)));
+  line_class in_diff = line_class::HEADER;
+
+  for (int i = 0; i < cached->nr_lines; i++) {
+    char *l = cached->lines[i];
+    line_class cls;
+
+    if (!strncmp(l, "diff ", 5)) {
+      cls = in_diff = line_class::FILE_HEADER;
+    } else if (in_diff == line_class::HEADER) {
+      /*
+       * message lines are indented, a blank line separates them. lines of
+       * --stat and --summary in a reduced diff are indented less.
+       */
+      if (!strncmp(l, "    ", 4))
+	cls = line_class::MESSAGE;
+      else if (l[0] == ' ')
+	cls = line_class::FILE_HEADER;
+      else if (l[0] == '\n' && i && classes[i - 1] != line_class::HEADER)
+	cls = line_class::MESSAGE;
+      else
+	cls = line_class::HEADER;
+    } else if (l[0] == '@' && l[1] == '@') {
+      cls = in_diff = line_class::HUNK_HEADER;
+    } else if (in_diff == line_class::FILE_HEADER) {
+      cls = line_class::FILE_HEADER;
+    } else {
+      switch (l[0]) {
+      case '+':
+	cls = line_class::ADDED;
+	break;
+      case '-':
+	cls = line_class::REMOVED;
+	break;
+      default:
+	cls = line_class::CONTEXT;
+	break;
+      }
+    }
+
+    classes[i] = cls;
+  }
+
+  cached->line_classes = classes;
+}
+
+/*
+ * path table: file lists of commits refer to interned paths with ids. paths
+ * are never freed, so names stay valid without the lock. commits are
+ * filled by other threads too.
+ */
+static pthread_mutex_t paths_lock = PTHREAD_MUTEX_INITIALIZER;
+static unordered_map<string, int> path_ids;
+static vector<const char *> path_names;
+
+static int intern_path(const char *path)
+{
+  pthread_mutex_lock(&paths_lock);
+
+  auto ret = path_ids.emplace(path, path_names.size());
+  if (ret.second) {
+    path_names.push_back(ret.first->first.c_str());
+    /* never freed, like nodes of the history */
+    mem_add(mem_category::PATHS, sizeof(*ret.first) + strlen(path) + 1
+	    + sizeof(const char *));
+  }
+  int id = ret.first->second;
+
+  pthread_mutex_unlock(&paths_lock);
+
+  return id;
+}
+
+static const char *path_name(int id)
+{
+  pthread_mutex_lock(&paths_lock);
+  const char *name = path_names[id];
+  pthread_mutex_unlock(&paths_lock);
+
+  return name;
+}
+
 static void init_commit_lines(struct commit *c)
 {
   struct commit_cached *cached = raw_get_cached(c);
   char *text = cached->text;
-  int text_size = cached->text_size;
+  size_t text_size = cached->text_size;
 
   cached->lines_size = LINES_INIT_SIZE;
   cached->lines = static_cast<char **>(xalloc(cached->lines_size * sizeof(char *)));
 
   char *line_head = text;
   cached->nr_lines = 0;
-  for (int i = 0; i < text_size; i++) {
+  for (size_t i = 0; i < text_size; i++) {
     if (text[i] != '\n')
       continue;
 
     cached->lines[cached->nr_lines++] = line_head;
 
-    if (line_head[0] == 'c') {
-      c->commit_id = static_cast<char *>(xalloc(41));
-      memcpy(c->commit_id, line_head + 7 /* strlen("commit ") */, 40);
-    }
-
     line_head = &text[i + 1];
 
     if (cached->lines_size == cached->nr_lines) {
@@ -232,8 +599,8 @@ static void init_commit_lines(struct commit *c)
     }
   }
 
-  if (c->summary)
-    return;
+  classify_lines(cached);
+  mem_add(mem_category::LINES, lines_usage(cached));
 
   for (int i = 0; i < cached->nr_lines; i++) {
     int j, len, nli;
@@ -249,6 +616,7 @@ static void init_commit_lines(struct commit *c)
     len = strlen(&line[j]);
     c->summary = static_cast<char *>(xalloc(len + 1));
     strcpy(c->summary, &line[j]);
+    mem_add(mem_category::SUMMARY, len + 1);
     line[j + nli] = '\n';
 
     break;
@@ -256,6 +624,7 @@ static void init_commit_lines(struct commit *c)
 
   const char *hdr = "+++ b/";
   int hdr_len = strlen(hdr);
+  vector<int> files;
 
   for (int i = 0; i < cached->nr_lines; i++) {
     char *l = cached->lines[i];
@@ -267,125 +636,259 @@ static void init_commit_lines(struct commit *c)
 
     int nl = ret_nl_index(l);
     l[nl] = '\0';
-    char *copied = strdup(l + hdr_len);
-    if (!copied)
-      die("strdup() failed\n");
+    files.push_back(intern_path(l + hdr_len));
     l[nl] = '\n';
+  }
 
-    if (c->nr_file_list == c->file_list_size) {
-      if (!c->file_list_size) {
-	assert(!c->nr_file_list);
-	c->file_list_size = 8;
-      } else
-	c->file_list_size <<= 1;
+  if (files.empty())
+    return;
 
-      c->file_list = static_cast<char **>(xrealloc(c->file_list,
-						   c->file_list_size * sizeof(char *)));
-    }
+  c->nr_file_list = files.size();
+  c->file_list = static_cast<int *>(xalloc(files.size() * sizeof(int)));
+  memcpy(c->file_list, files.data(), files.size() * sizeof(int));
+  mem_add(mem_category::FILE_LIST, files.size() * sizeof(int));
+}
 
-    c->file_list[c->nr_file_list++] = copied;
+/* free_commit_metadata(): free what init_commit_lines() derived from text */
+static void free_commit_metadata(struct commit *c)
+{
+  if (c->summary) {
+    mem_sub(mem_category::SUMMARY, strlen(c->summary) + 1);
+    free(c->summary);
+    c->summary = NULL;
   }
 
-  int i = 0;
-  int commit_log_begin_idx = -1, commit_log_end_idx = -1;
-  for (int state = 0; i < cached->nr_lines; i++) {
-    char *l = cached->lines[i];
+  mem_sub(mem_category::FILE_LIST, c->nr_file_list * sizeof(int));
+  free(c->file_list);
+  c->file_list = NULL;
+  c->nr_file_list = 0;
+}
 
-    switch (state) {
-    case 0:
-      if (!strlen(l))
-	continue;
+/*
+ * the cache of commit texts can be used from several threads. states and pins
+ * of commits, the size order and the ticket index (built when texts are
+ * filled) are protected by cache_lock. git show for a commit runs only once:
+ * a commit in LOADING state is waited for by others instead of loaded again.
+ * a pinned text is never evicted, it can be read without the lock.
+ */
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+/* broadcast when a load is filled or discarded */
+static pthread_cond_t cache_load_finished = PTHREAD_COND_INITIALIZER;
 
-      if (l[0] == ' ') {
-	state = 1; /* beginning of commit log */
-	commit_log_begin_idx = i;
-      }
+/* loads in the main loop are progressed only by the main thread */
+static pthread_t main_thread;
 
-      break;
-    case 1:
-      if (l[0] == '\n') {
-	commit_log_end_idx = i;
-	break;
-      }
+static struct commit *size_order_head;
 
-      break;
-    default:
-      die("unknown state of commit log parser: %d\n", state);
-      break;
-    }
-  }
+/*
+ * commits larger than SPILL_THRESHOLD are spilled to unlinked temporary
+ * files. they don't consume alloc_lim, spilled texts are bounded by SPILL_LIM
+ */
+#define SPILL_THRESHOLD ((size_t)64 << 20)
+#define SPILL_LIM ((size_t)16 << 30)
 
-  if (commit_log_end_idx == -1)
-    commit_log_end_idx = i - 1;
+/*
+ * purge_commit(): free the text of the filled commit c, return its size.
+ * called with cache_lock held.
+ */
+static size_t purge_commit(struct commit *c)
+{
+  struct commit_cached *cached = raw_get_cached(c);
 
-  assert(commit_log_begin_idx != -1 && commit_log_end_idx != -1);
+  assert(!cached->pins);
 
-  c->commit_log_lines = commit_log_end_idx - commit_log_begin_idx;
-  c->commit_log = static_cast<char **>(xalloc(c->commit_log_lines * sizeof(char *)));
-  for (int i = commit_log_begin_idx, j = 0; i < commit_log_end_idx; i++, j++) {
-    char *copied, *l;
+  if (cached->spilled) {
+    munmap(cached->text, cached->text_size);
+    mem_sub(mem_category::SPILLED_TEXT, cached->text_size);
+  } else {
+    free(cached->text);
+    mem_sub(mem_category::TEXT, cached->text_size);
+  }
+  cached->text = NULL;
 
-    l = cached->lines[i];
-    int nl = ret_nl_index(l);
-    l[nl] = '\0';
-    copied= strdup(l);
-    l[nl] = '\n';
-    if (!copied)
-      die("strdup() failed\n");
+  mem_sub(mem_category::LINES, lines_usage(cached));
+  free(cached->lines);
+  cached->lines = NULL;
+  free(cached->line_classes);
+  cached->line_classes = NULL;
 
-    c->commit_log[j] = copied;
-  }
-}
+  free_commit_metadata(c);
+  free_display(cached);
 
-static struct commit *size_order_head;
+  cached->state = commit_cached_state::PURGED;
 
-#define ALLOC_LIM (1 << 30)
-static size_t total_alloced;
+  return cached->text_size;
+}
 
-static void free_commits(size_t size)
+static bool mem_over_limit(size_t size, bool spilled)
 {
-  size_t freed = 0;
+  if (spilled)
+    return SPILL_LIM < mem_get(mem_category::SPILLED_TEXT) + size;
+
+  return __atomic_load_n(&alloc_lim, __ATOMIC_RELAXED)
+    < mem_heap_usage() + size;
+}
 
+/*
+ * free_commits(): purge commits from larger ones until size bytes fit in the
+ * limit. the limits are soft, pinned texts (including the one on the screen)
+ * and metadata of the history (nodes, the commit list, interned paths) are
+ * never purged.
+ * called with cache_lock held.
+ */
+static void free_commits(size_t size, bool spilled)
+{
   for (struct commit *p = size_order_head; p; p = p->size_next) {
     struct commit_cached *pc = raw_get_cached(p);
 
-    if (pc->state == commit_cached_state::PURGED)
+    if (!mem_over_limit(size, spilled))
+      break;
+
+    if (pc->state != commit_cached_state::FILLED)
+      continue;
+
+    if (pc->spilled != spilled)
       continue;
 
-    free(pc->text);
-    pc->text = NULL;
-    free(pc->lines);
-    pc->lines = NULL;
+    if (pc->pins)
+      continue;
 
-    pc->state = commit_cached_state::PURGED;
+    purge_commit(p);
+  }
 
-    freed += pc->text_size;
-    if (size < freed)
-      break;
+  debug_print_mem_usage("evicted");
+}
+
+/* evict_commit(): purge the text of c unless it is pinned or not filled */
+static bool evict_commit(struct commit *c)
+{
+  struct commit_cached *cached = raw_get_cached(c);
+  bool evicted = false;
+
+  pthread_mutex_lock(&cache_lock);
+  if (cached->state == commit_cached_state::FILLED && !cached->pins) {
+    purge_commit(c);
+    evicted = true;
   }
+  pthread_mutex_unlock(&cache_lock);
 
-  if (freed < size)
-    die("memory allocation failed\n");
+  return evicted;
+}
+
+/* size_order_unlink(): remove c from the size order, called with cache_lock held */
+static void size_order_unlink(struct commit *c)
+{
+  if (!c->size_order_initialized)
+    return;
+
+  struct commit **pp = &size_order_head;
+  while (*pp != c)
+    pp = &(*pp)->size_next;
+  *pp = c->size_next;
+
+  c->size_next = nullptr;
+  c->size_order_initialized = false;
+}
+
+/*
+ * free_commit(): free c dropped from the history, with its text. called with
+ * cache_lock held when c isn't pinned.
+ */
+static void free_commit(struct commit *c)
+{
+  assert(c->gone && !c->cached.pins);
+
+  if (c->cached.state == commit_cached_state::FILLED)
+    purge_commit(c);
+
+  size_order_unlink(c);
+
+  mem_sub(mem_category::NODE, sizeof(*c));
+  free(c);
+}
+
+static void init_alloc_lim(void)
+{
+  size_t limit = mem_limit();
+
+  if (limit)
+    alloc_lim = max(ALLOC_LIM_MIN, limit / 2);
+  alloc_lim_initial = alloc_lim;
+}
+
+static int pressure_fd = -1;
+static struct timespec pressure_at;
+
+/*
+ * shrink_cache(): halve the heap on memory pressure, before the kernel
+ * reclaims or kills. the budget is kept low until the pressure goes away.
+ */
+static void shrink_cache(void)
+{
+  pthread_mutex_lock(&cache_lock);
+  size_t lim = max(ALLOC_LIM_MIN, min(alloc_lim, mem_heap_usage()) / 2);
+  __atomic_store_n(&alloc_lim, lim, __ATOMIC_RELAXED);
+  free_commits(0, false);
+  pthread_mutex_unlock(&cache_lock);
+
+  clock_gettime(CLOCK_MONOTONIC, &pressure_at);
+  if (debug_file)
+    debug_printf("memory pressure, budget: %zu\n", lim);
+}
+
+/*
+ * pressure_timeout(): ms until the lowered budget is recovered, -1 if it
+ * isn't lowered. poll() wakes up for it even without any activity.
+ */
+static int pressure_timeout(void)
+{
+  if (alloc_lim == alloc_lim_initial)
+    return -1;
+
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  long elapsed = (now.tv_sec - pressure_at.tv_sec) * 1000
+    + (now.tv_nsec - pressure_at.tv_nsec) / 1000000;
+
+  return elapsed < PRESSURE_RECOVERY_MS ? PRESSURE_RECOVERY_MS - elapsed : 0;
+}
+
+/* recover_alloc_lim(): double the lowered budget per quiet period */
+static void recover_alloc_lim(void)
+{
+  if (pressure_timeout())
+    return;
 
-  total_alloced -= freed;
+  pthread_mutex_lock(&cache_lock);
+  size_t lim = min(alloc_lim_initial, alloc_lim * 2);
+  __atomic_store_n(&alloc_lim, lim, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&cache_lock);
+
+  clock_gettime(CLOCK_MONOTONIC, &pressure_at);
 }
 
+/* text_alloc(): called with cache_lock held */
 static void text_alloc(struct commit *c)
 /* FIXME: clearly, I need a smart algorithm... */
 {
   struct commit_cached *cached = raw_get_cached(c);
   size_t size = cached->text_size;
 
-  if (ALLOC_LIM < total_alloced + size)
-    free_commits(size);
+  if (mem_over_limit(size, cached->spilled))
+    free_commits(size, cached->spilled);
 
-  total_alloced += size;
-  cached->text = static_cast<char *>(calloc(sizeof(char), size));
-  if (!cached->text)
-    die("memory allocation failed");
+  if (cached->spilled) {
+    /* text is already mapped by spill_text() */
+    mem_add(mem_category::SPILLED_TEXT, size);
+  } else {
+    mem_add(mem_category::TEXT, size);
+    cached->text = static_cast<char *>(calloc(sizeof(char), size));
+    if (!cached->text)
+      die("memory allocation failed");
+  }
 
-  if (c->size_order_initialized)
-    return;
+  /* a reloaded text can have another size, e.g. a full diff after its stat */
+  size_order_unlink(c);
 
   if (!size_order_head) {
     size_order_head = c;
@@ -424,18 +927,24 @@ static void text_alloc(struct commit *c)
   c->size_order_initialized = true;
 }
 
-char *read_from_fd(int fd, unsigned int *len)
+/*
+ * read_from_fd(): read from fd until EOF or lim bytes are read.
+ * returned buffer is reused by the next call.
+ */
+char *read_from_fd(int fd, size_t *len, size_t lim)
 {
   static char *buf;
-  static int buf_size;
+  static size_t buf_size;
 
   if (!buf) {
     buf_size = 1024;
     buf = static_cast<char *>(xalloc(buf_size));
   }
 
-  int rbytes = 0, ret;
-  while ((ret = read(fd, buf + rbytes, buf_size - rbytes))) {
+  size_t rbytes = 0;
+  ssize_t ret;
+  while (rbytes < lim
+	 && (ret = read(fd, buf + rbytes, min(buf_size, lim) - rbytes))) {
     if (ret == -1) {
       if (errno == EINTR)
 	continue;
@@ -445,7 +954,7 @@ char *read_from_fd(int fd, unsigned int *len)
 
     rbytes += ret;
 
-    if (rbytes == buf_size) {
+    if (rbytes == buf_size && buf_size < lim) {
       /* expand only */
       buf_size <<= 1;
       buf = static_cast<char *>(xrealloc(buf, buf_size));
@@ -456,1822 +965,5731 @@ char *read_from_fd(int fd, unsigned int *len)
   return buf;
 }
 
-static void read_commit_with_git_show(struct commit *c)
+static int open_spill_file(void)
 {
-  int pipefds[2];
-  if (pipe(pipefds))
-    die("pipe() failed\n");
+  const char *dir = getenv("TMPDIR");
+  if (!dir)
+    dir = "/var/tmp";
+
+  int fd = open(dir, O_TMPFILE | O_RDWR, S_IRUSR | S_IWUSR);
+  if (0 <= fd)
+    return fd;
+
+  /* file systems without O_TMPFILE */
+  char path[PATH_MAX];
+  snprintf(path, PATH_MAX, "%s/glg-spill-XXXXXX", dir);
+  fd = mkstemp(path);
+  if (fd < 0)
+    die("mkstemp() failed\n");
+  unlink(path);
+
+  return fd;
+}
 
-  char *ret = nullptr;
-  pid_t pid = fork();
-  switch (pid) {
-  case 0:
-    close(1);
-    dup(pipefds[1]);
-    close(pipefds[0]);
-    if (execlp("git", "git", "show", c->commit_id, NULL))
-      die("execlp() failed\n");
+static void write_all(int fd, const char *buf, size_t len)
+{
+  size_t wbytes = 0;
 
-    break;
+  while (wbytes < len) {
+    ssize_t wret = write(fd, buf + wbytes, len - wbytes);
+    if (wret < 0) {
+      if (errno == EINTR)
+	continue;
 
-  case -1:
-    die("fork() failed\n");
-    break;
+      die("write() failed\n");
+    }
 
-  default:
-    close(pipefds[1]);
-    ret = read_from_fd(pipefds[0], &c->cached.text_size);
-    waitpid(pid, NULL, 0);
-    close(pipefds[0]);
-    break;
+    wbytes += wret;
   }
-
-  text_alloc(c);
-  memcpy(c->cached.text, ret, c->cached.text_size);
 }
 
-static struct commit_cached *get_cached(struct commit *c)
+static unsigned long page_size;
+
+#define page_align_down(p) ((char *)((unsigned long)(p) & ~(page_size - 1)))
+#define page_align_up(p) page_align_down((char *)(p) + page_size - 1)
+
+/*
+ * release_cold_pages(): drop pages of a spilled text which are not on the
+ * screen. they are read back from the temporary file when touched again.
+ */
+static void release_cold_pages(struct commit *c)
 {
-  if (c->cached.state == commit_cached_state::FILLED)
-    return &c->cached;
+  struct commit_cached *cached = raw_get_cached(c);
 
-  assert(!c->cached.text);
-  read_commit_with_git_show(c);
-  init_commit_lines(c);
-  c->cached.state = commit_cached_state::FILLED;
+  if (!cached->spilled || cached->state != commit_cached_state::FILLED)
+    return;
 
-  return &c->cached;
-}
+  char *begin = cached->text, *end = cached->text + cached->text_size;
+  char *hot_begin = end, *hot_end = end;
 
-/* head: HEAD, root: root of the commit tree */
-static struct commit *head, *root;
-/* current: current displaying commit, tail: tail of the read commits */
-static struct commit *tail;
-static struct commit *range_begin, *range_end;
+  if (c == current && c->head_line < cached->nr_lines) {
+    int last = min(c->head_line + (int)row, cached->nr_lines);
 
-static regex_t *re_compiled;
+    hot_begin = page_align_down(cached->lines[c->head_line]);
+    if (last < cached->nr_lines)
+      hot_end = page_align_up(cached->lines[last]);
+  }
 
-static char **tokenized_query;
-static int nr_tokenized_query, tokenized_query_size;
+  if (begin < hot_begin)
+    madvise(begin, hot_begin - begin, MADV_DONTNEED);
+  if (hot_end < page_align_down(end))
+    madvise(hot_end, page_align_down(end) - hot_end, MADV_DONTNEED);
+}
 
-static void coloring(char ch, int on)
-{
-  int color = 0;
+/*
+ * commit_load: an on-going git show, its output is read without blocking
+ * in the main loop as it arrives.
+ */
+struct commit_load {
+  struct commit *commit;
+  pid_t pid;
+  int fd;
+
+  char *buf;
+  size_t len, size;
+
+  /*
+   * texts reaching SPILL_THRESHOLD are written to spill_fd if spill is true,
+   * otherwise the load is aborted
+   */
+  bool spill;
+  int spill_fd;
+  size_t spill_size;
+
+  /* the diff is generated again at a lower level when over the budgets */
+  diff_level level;
+  struct timespec started_at;
+
+  /*
+   * done(): called after the process is finished. it must call load_fill() or
+   * load_discard() unless aborted. return 1 for updating the screen.
+   */
+  int (*done)(struct commit_load *l, bool aborted);
+};
 
-  switch (ch) {
-  case '+':
-    color = COLOR_PAIR(COLORING_PLUS);
-    break;
-  case '-':
-    color = COLOR_PAIR(COLORING_MINUS);
-    break;
-  case '@':
-    color = COLOR_PAIR(COLORING_ATMARK);
-    break;
-  case 'c':
-    color = COLOR_PAIR(COLORING_COMMIT);
-    break;
+/* loads for the current commit on the screen and a running search */
+static struct commit_load screen_load, search_load;
 
-  default:
-    return;
+/*
+ * diff budgets: git show taking longer than DIFF_TIME_BUDGET_MS, e.g. with
+ * rename detection of a huge commit, is restarted without renames, then with
+ * --stat. texts over DIFF_SIZE_BUDGET are loaded with --stat. only the screen
+ * is budgeted: searches, the match list and prefetches would miss matches in
+ * reduced diffs. a full diff is also loaded when it is requested.
+ */
+#define DIFF_TIME_BUDGET_MS 1500
+#define DIFF_SIZE_BUDGET ((size_t)32 << 20)
 
-    break;
-  }
+#define load_budgeted(l) ((l) == &screen_load && !(l)->commit->full_diff)
 
-  if (on)
-    attron(color);
-  else
-    attroff(color);
+static void load_launch(struct commit_load *l)
+{
+  struct commit *c = l->commit;
+
+  l->pid = launch_git_show(c->commit_id, l->level != diff_level::FULL,
+			   l->level == diff_level::STAT, &l->fd);
+  fcntl(l->fd, F_SETFL, fcntl(l->fd, F_GETFL) | O_NONBLOCK);
+  clock_gettime(CLOCK_MONOTONIC, &l->started_at);
+  l->len = 0;
+  l->spill_fd = -1;
+  l->spill_size = 0;
 }
 
-static void update_terminal_default(void)
+/*
+ * load_start(): start git show for c. false if c is already loaded or being
+ * loaded by someone else, the load is shared then.
+ */
+static bool load_start(struct commit_load *l, struct commit *c, bool spill,
+		       int (*done)(struct commit_load *, bool))
 {
-  move(0, 0);
-  clear();
+  pthread_mutex_lock(&cache_lock);
+  if (c->cached.state != commit_cached_state::PURGED) {
+    pthread_mutex_unlock(&cache_lock);
+    return false;
+  }
+  c->cached.state = commit_cached_state::LOADING;
+  pthread_mutex_unlock(&cache_lock);
 
-  struct commit_cached *cached = get_cached(current);
+  assert(!l->commit);
 
-  int bm_len = strlen(bottom_message);
+  l->commit = c;
+  l->level = diff_level::FULL;
+  l->spill = spill;
+  l->done = done;
+  load_launch(l);
 
-  int i;
-  for (i = current->head_line;
-       i < current->head_line + row - !!bm_len && i < cached->nr_lines;
-       i++) {
-    int j;
-    char first_char;
-    char *line;
+  return true;
+}
 
-    line = cached->lines[i];
-    first_char = line[0];
+static void load_finish_process(struct commit_load *l, bool kill_process)
+{
+  if (kill_process)
+    kill(l->pid, SIGKILL);
+  waitpid(l->pid, NULL, 0);
+  close(l->fd);
+  l->fd = -1;
+}
 
-    coloring(first_char, 1);
+/* load_reduce(): restart the load of the same commit at level */
+static void load_reduce(struct commit_load *l, diff_level level)
+{
+  load_finish_process(l, true);
+  if (l->spill_fd != -1)
+    close(l->spill_fd);
 
-    if (state == main_loop_state::SEARCHING_QUERY) {
-      if (current_search_type == search_type::REGEX) {
-	int ret, mi, nli = ret_nl_index(line);
-	int rev = 0;
+  if (debug_file)
+    debug_printf("diff of %s is over the budgets, level: %d\n",
+		 l->commit->commit_id, (int)level);
 
-	line[nli] = '\0';
-	ret = regexec(re_compiled, line,
-		      match_array_size, match_array, 0);
-	line[nli] = '\n';
+  l->level = level;
+  load_launch(l);
+}
 
-	if (ret)
-	  goto normal_print;
+/* load_timeout(): ms until the time budget of l runs out, -1 if none */
+static int load_timeout(struct commit_load *l)
+{
+  if (!l->commit || !load_budgeted(l) || l->level == diff_level::STAT)
+    return -1;
 
-	for (mi = j = 0; j < col && line[j] != '\n'; j++) {
-	  if (j == match_array[mi].rm_so) {
-	    attron(A_REVERSE);
-	    rev = 1;
-	  } else if (j == match_array[mi].rm_eo) {
-	    attroff(A_REVERSE);
-	    rev = 0;
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  long elapsed = (now.tv_sec - l->started_at.tv_sec) * 1000
+    + (now.tv_nsec - l->started_at.tv_nsec) / 1000000;
 
-	    mi++;
-	  }
+  return elapsed < DIFF_TIME_BUDGET_MS ? DIFF_TIME_BUDGET_MS - elapsed : 0;
+}
 
-	  if (match_array[mi].rm_so
-	      == match_array[mi].rm_eo) {
-	    attroff(A_REVERSE);
-	    rev = 0;
+/* load_check_time(): go down a level if the time budget has run out */
+static void load_check_time(struct commit_load *l)
+{
+  if (load_timeout(l))
+    return;
 
-	    mi++;
-	  }
+  load_reduce(l, l->level == diff_level::FULL ?
+	      diff_level::NO_RENAMES : diff_level::STAT);
+}
 
-	  addch(line[j]);
-	}
+/*
+ * map_spilled_text(): the mapping is private and writable because lines are
+ * temporarily NUL terminated in place, touched pages are simply copied on
+ * write.
+ */
+static void map_spilled_text(struct commit_load *l)
+{
+  struct commit_cached *cached = raw_get_cached(l->commit);
+
+  void *text = mmap(NULL, l->spill_size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+		    l->spill_fd, 0);
+  if (text == MAP_FAILED)
+    die("mmap() failed\n");
+  close(l->spill_fd);
+  l->spill_fd = -1;
+
+  cached->text = static_cast<char *>(text);
+  cached->text_size = l->spill_size;
+  cached->spilled = true;
+  text_alloc(l->commit);
+}
 
-	if (rev)
-	  attroff(A_REVERSE);
-      } else {
-	/* FIXME: disaster... */
+/* index_commit_tickets(): add tickets in the message of c to the index */
+static void index_commit_tickets(struct commit *c)
+{
+  struct commit_cached *cached = &c->cached;
 
-	assert(current_search_type == search_type::FTS);
+  for (int i = 0; i < cached->nr_lines; i++) {
+    if (cached->line_classes[i] != line_class::MESSAGE)
+      continue;
 
-	int nli = ret_nl_index(line);
-	for (int i = 0; i < nli; i++) {
-	skip_token_print:
+    char *line = cached->lines[i];
+    int nli = ret_nl_index(line);
+    line[nli] = '\0';
+    ticket_index_line(line, c->log_idx);
+    line[nli] = '\n';
+  }
+}
 
-	  for (int j = 0; j < nr_tokenized_query; j++) {
-	    char *q = tokenized_query[j];
-	    int q_len = strlen(q);
+/* fill_commit(): called with cache_lock held */
+static void fill_commit(struct commit *c)
+{
+  init_commit_lines(c);
+  /* tickets are indexed with positions in the entire history */
+  if (!file_history_path)
+    index_commit_tickets(c);
+  c->cached.state = commit_cached_state::FILLED;
+  release_cold_pages(c);
+}
 
-	    if (nli - i < q_len)
-	      continue;
+/* load_fill(): store the read text to the cache */
+static void load_fill(struct commit_load *l)
+{
+  struct commit *c = l->commit;
 
-	    if (strncmp(q, line + i, q_len))
-	      continue;
+  pthread_mutex_lock(&cache_lock);
 
-	    attron(A_REVERSE);
-	    for (int k = 0; k < q_len; k++)
-	      addch(q[k]);
-	    attroff(A_REVERSE);
+  c->cached.spilled = false;
+  c->cached.level = l->level;
+  if (l->spill_fd != -1) {
+    write_all(l->spill_fd, l->buf, l->len);
+    l->spill_size += l->len;
+    map_spilled_text(l);
+  } else {
+    c->cached.text_size = l->len;
+    text_alloc(c);
+    memcpy(c->cached.text, l->buf, l->len);
+  }
 
-	    i += q_len;
-	    goto skip_token_print;
-	  }
+  fill_commit(c);
 
-	  addch(line[i]);
-	}
-      }
-    } else {
-    normal_print:
-      for (j = 0; j < col && line[j] != '\n'; j++)
-	addch(line[j]);
+  pthread_cond_broadcast(&cache_load_finished);
+  pthread_mutex_unlock(&cache_lock);
 
-    }
+  l->commit = NULL;
+}
 
-    addch('\n');
-    coloring(first_char, 0);
+/* load_discard(): throw away the read text, the commit is loaded later */
+static void load_discard(struct commit_load *l)
+{
+  if (l->spill_fd != -1) {
+    close(l->spill_fd);
+    l->spill_fd = -1;
   }
 
-  while (i++ < current->head_line + row - !!bm_len)
-    addch('\n');
+  pthread_mutex_lock(&cache_lock);
+  l->commit->cached.state = commit_cached_state::PURGED;
+  pthread_cond_broadcast(&cache_load_finished);
+  pthread_mutex_unlock(&cache_lock);
 
-  move(row - !!bm_len, 0);
-  attron(A_REVERSE);
+  l->commit = NULL;
+}
 
-  char bm_buf[row + 1];	/* we are using C99 */
-  char *p = bm_buf;
+static void load_cancel(struct commit_load *l)
+{
+  if (!l->commit)
+    return;
 
-  if (cached->nr_lines <= current->head_line + row)
-    snprintf(p, row, "100%%");
-  else
-    snprintf(p, row, "% .0f%%",
-	     (float)(current->head_line + row)
-	     / cached->nr_lines * 100.0);
-  p += strlen(p);
+  load_finish_process(l, true);
+  load_discard(l);
+}
 
-  if (current->head_line + row < cached->nr_lines)
-    snprintf(p, row - strlen(p), " (%d/%d)",
-	     current->head_line + row, cached->nr_lines);
-  else
-    snprintf(p, row - strlen(p), " (%d/%d)",
-	     cached->nr_lines, cached->nr_lines);
-  p += strlen(p);
+/* buffers of loads larger than this are freed after each load */
+#define LOAD_BUF_KEEP (1 << 20)
 
-  snprintf(p, row - strlen(p), "   ");
-  p += strlen(p);
+static void load_release_buf(struct commit_load *l)
+{
+  mem_sub(mem_category::LOAD_BUF, l->size);
+  free(l->buf);
+  l->buf = NULL;
+  l->len = l->size = 0;
+}
 
-  for (i = 0; i < 8; i++) {
-    snprintf(p, row - strlen(p), "%c",
-	     current->commit_id[i]);
-    p += strlen(p);
-  }
-  snprintf(p, row - strlen(p), ": ");
-  p += strlen(p);
+/* load_done(): call done(), the buffer has no valid data after that */
+static int load_done(struct commit_load *l, bool aborted)
+{
+  int ret = l->done(l, aborted);
 
-  char summary[81];
-  snprintf(summary, 80, "%s", current->summary);
-  snprintf(p, row - strlen(p), "%s", summary);
-  p += strlen(p);
+  if (LOAD_BUF_KEEP < l->size)
+    load_release_buf(l);
 
-  printw("%s", bm_buf);
+  return ret;
+}
 
-  if (bm_len) {
-    move(row, 0);
-    printw("%s", bottom_message);
-  }
+/*
+ * load_progress(): read available output of the process.
+ * return value of done() when the load finished, 0 otherwise.
+ */
+static int load_progress(struct commit_load *l)
+{
+  while (1) {
+    if (l->len == l->size) {
+      mem_sub(mem_category::LOAD_BUF, l->size);
+      l->size = l->size ? l->size << 1 : 1024;
+      l->buf = static_cast<char *>(xrealloc(l->buf, l->size));
+      mem_add(mem_category::LOAD_BUF, l->size);
+    }
 
-  attroff(A_REVERSE);
+    ssize_t ret = read(l->fd, l->buf + l->len, l->size - l->len);
+    if (ret < 0) {
+      if (errno == EINTR)
+	continue;
+      if (errno == EAGAIN)
+	return 0;
 
-  refresh();
-}
+      die("read() failed\n");
+    }
 
-struct help_str {
-  char cmd;
-  char *desc;
-};
+    if (!ret)
+      break;
 
-struct help_str help_str_array[] = {
-#define cmd(cmd, func, desc) { cmd, static_cast<char *>(const_cast<char *>(desc)) },
-#include "default_cmd.def"
-#undef cmd
-  { '\0', NULL }
-};
+    l->len += ret;
 
-static void update_terminal_help(void)
-{
-  int i;
+    if (load_budgeted(l) && l->level != diff_level::STAT
+	&& DIFF_SIZE_BUDGET <= l->spill_size + l->len) {
+      load_reduce(l, diff_level::STAT);
+      continue;
+    }
 
-  move(0, 0);
+    if (l->len < SPILL_THRESHOLD)
+      continue;
 
-  printw("keystorkes supported in default state\n\n");
-  for (i = 0; help_str_array[i].cmd != '\0' ; i++) {
-    printw("%c: %s\n", help_str_array[i].cmd,
-	   help_str_array[i].desc);
-  }
+    if (!l->spill) {
+      load_finish_process(l, true);
+      load_discard(l);
+      return load_done(l, true);
+    }
 
-  while (i++ < row)
-    addch('\n');
+    if (l->spill_fd == -1)
+      l->spill_fd = open_spill_file();
 
-  refresh();
+    write_all(l->spill_fd, l->buf, l->len);
+    l->spill_size += l->len;
+    l->len = 0;
+  }
+
+  load_finish_process(l, false);
+  return load_done(l, false);
 }
 
-static void update_terminal_show_changed_files(void)
+/* load_wait(): complete the load, blocking until it finishes */
+static void load_wait(struct commit_load *l)
 {
-  move(0, 0);
+  while (l->commit) {
+    struct pollfd pfd = { l->fd, POLLIN, 0 };
 
-  printw("files changed in this commit:\n");
+    if (poll(&pfd, 1, load_timeout(l)) < 0 && errno != EINTR)
+      die("poll() failed\n");
 
-  int i;
-  for (i = 0; i < current->nr_file_list; i++) {
-    printw(" %s\n", current->file_list[i]);
+    load_check_time(l);
+    load_progress(l);
   }
+}
 
-  while (i++ < row - 1)
-    addch('\n');
+static int load_compl_fill(struct commit_load *l, bool aborted)
+{
+  if (!aborted)
+    load_fill(l);
 
-  printw("type 'q' to quit this mode\n");
-  refresh();
+  return 1;
 }
 
+static struct commit_load *find_load(struct commit *c);
 
-static void update_terminal(void)
+/*
+ * cache_pin(): load the text of c if needed and pin it until cache_unpin().
+ * the main thread progresses a load of the main loop by itself, other
+ * threads wait for it.
+ */
+static struct commit_cached *cache_pin(struct commit *c)
 {
-  switch (state) {
-  case main_loop_state::DEFAULT:
-  case main_loop_state::INPUT_SEARCH_QUERY:
-  case main_loop_state::SEARCHING_QUERY:
-  case main_loop_state::INPUT_SEARCH_FILTER:
-  case main_loop_state::INPUT_SEARCH_FILTER2:
-  case main_loop_state::INPUT_SEARCH_DIRECTION:
-  case main_loop_state::LAUNCH_GIT_COMMAND:
-  case main_loop_state::READ_BRANCHNAME_FOR_CHECKOUT:
-    update_terminal_default();
-    break;
+  struct commit_cached *cached = raw_get_cached(c);
+  bool in_main = pthread_equal(pthread_self(), main_thread);
 
-  case main_loop_state::SHOW_CHANGED_FILES:
-    update_terminal_show_changed_files();
-    break;
+  pthread_mutex_lock(&cache_lock);
 
-  case main_loop_state::HELP:
-    update_terminal_help();
-    break;
+  while (cached->state != commit_cached_state::FILLED) {
+    struct commit_load *l = NULL;
 
-  default:
-    die("unknown state: %d\n", state);
-    break;
-  };
+    if (cached->state == commit_cached_state::LOADING) {
+      if (!in_main || !(l = find_load(c))) {
+	pthread_cond_wait(&cache_load_finished, &cache_lock);
+	continue;
+      }
+
+      pthread_mutex_unlock(&cache_lock);
+      load_wait(l);
+      pthread_mutex_lock(&cache_lock);
+
+      /* a prefetch can discard the text, it is loaded below then */
+      continue;
+    }
+
+    pthread_mutex_unlock(&cache_lock);
+
+    struct commit_load sync_load;
+    memset(&sync_load, 0, sizeof(sync_load));
+    if (load_start(&sync_load, c, true, load_compl_fill)) {
+      load_wait(&sync_load);
+      load_release_buf(&sync_load);
+    }
+
+    pthread_mutex_lock(&cache_lock);
+  }
+
+  cached->pins++;
+  pthread_mutex_unlock(&cache_lock);
+
+  return cached;
 }
 
-static void signal_handler(int signum)
+/* cache_pin_nowait(): pin the text of c, NULL while it is not loaded */
+static struct commit_cached *cache_pin_nowait(struct commit *c)
 {
-  switch (signum) {
-  case SIGWINCH:
-    update_row_col();
-    update_terminal();
-    break;
+  struct commit_cached *cached = raw_get_cached(c);
 
-  case SIGINT:
-    if (state_long_run == long_run::RUNNING)
-      /* FIXME: use signalfd */
-      state_long_run = long_run::STOPPED;
-    break;
+  pthread_mutex_lock(&cache_lock);
+  if (cached->state == commit_cached_state::FILLED)
+    cached->pins++;
+  else
+    cached = NULL;
+  pthread_mutex_unlock(&cache_lock);
 
-  default:
-    die("unknown signal: %d", signum);
-    break;
-  }
+  return cached;
 }
 
-static int init_signalfd(void)
+static void cache_unpin(struct commit *c)
 {
-  sigset_t mask;
-  int sigfd;
+  pthread_mutex_lock(&cache_lock);
+  assert(0 < c->cached.pins);
+  if (!--c->cached.pins && c->gone)
+    free_commit(c);
+  pthread_mutex_unlock(&cache_lock);
+}
 
-  sigemptyset(&mask);
-  sigaddset(&mask, SIGWINCH);
-  sigaddset(&mask, SIGINT);
-  sigprocmask(SIG_BLOCK, &mask, NULL);
+/* cache_filled(): the text of c may be evicted soon unless pinned */
+static bool cache_filled(struct commit *c)
+{
+  pthread_mutex_lock(&cache_lock);
+  bool filled = c->cached.state == commit_cached_state::FILLED;
+  pthread_mutex_unlock(&cache_lock);
 
-  sigfd = signalfd(-1, &mask, SFD_NONBLOCK);
-  if (sigfd < 0) {
-    fprintf(stderr, "signalfd() failed: %s\n",
-	    strerror(errno));
-    exit(1);
+  return filled;
+}
+
+/*
+ * search_filled(): the full text of c is cached for searches. a diff reduced
+ * for the screen is purged to be loaded in full, unless it is pinned (e.g.
+ * on the screen, where the status line tells it is reduced).
+ */
+static bool search_filled(struct commit *c)
+{
+  struct commit_cached *cached = raw_get_cached(c);
+
+  pthread_mutex_lock(&cache_lock);
+  bool filled = cached->state == commit_cached_state::FILLED;
+  if (filled && cached->level != diff_level::FULL && !cached->pins) {
+    purge_commit(c);
+    filled = false;
   }
+  pthread_mutex_unlock(&cache_lock);
 
-  return sigfd;
+  return filled;
 }
 
-static void read_commit(void)
+/*
+ * screen_cached(): the text of current, NULL while it is not loaded. the text
+ * on the screen stays pinned until another commit is shown.
+ */
+static struct commit *screen_pinned;
+
+static struct commit_cached *screen_cached(void)
 {
-  static int read_end;
+  if (screen_pinned == current)
+    return raw_get_cached(current);
 
-  if (read_end)
-    return;
+  struct commit_cached *cached = cache_pin_nowait(current);
+  if (!cached)
+    return NULL;
 
-  char commit_id[41];	/* with '\0' */
+  if (screen_pinned)
+    cache_unpin(screen_pinned);
+  screen_pinned = current;
 
-  int ret, rbytes = 0;
+  return cached;
+}
 
-  while ((ret = read(stdin_fd, commit_id + rbytes, 41 - rbytes))) {
-    if (ret == -1) {
-      if (errno == EINTR)
-	continue;
+/* screen_unpin(): release the text on the screen, e.g. for reloading it */
+static void screen_unpin(void)
+{
+  if (screen_pinned)
+    cache_unpin(screen_pinned);
+  screen_pinned = NULL;
+}
 
-      die("read() failed\n");
-    }
+/* head: HEAD, root: root of the commit tree */
+static struct commit *head, *root;
+/* current: current displaying commit, tail: tail of the read commits */
+static struct commit *tail;
+static struct commit *range_begin, *range_end;
 
-    rbytes += ret;
-    if (rbytes == 41)
-      break;
-  }
+static regex_t *re_compiled;
 
-  if (!ret)
-    read_end = 1;
-  else
-    assert(commit_id[40] == '\n');
+static char **tokenized_query;
+static int nr_tokenized_query, tokenized_query_size;
 
-  commit_id[40] = '\0';
+/*
+ * number of commits in the history. an estimation from commit-graph is
+ * replaced with the result of git rev-list --count running in background.
+ */
+static long nr_history = -1;
+static bool nr_history_estimated;
 
-  struct commit *new_commit = static_cast<struct commit *>(xalloc(sizeof(*new_commit)));
+static struct {
+  pid_t pid;
+  int fd;
 
-  if (tail) {
-    assert(!tail->prev);
+  char buf[32];
+  int len;
+} history_count = { 0, -1 };
 
-    tail->prev = new_commit;
-    new_commit->next = tail;
-    tail = new_commit;
-  } else {
-    /* very unlikely */
-    assert(!head && !tail);
+/* git_path(): path of name in the git directory, free() it. NULL on error */
+static char *git_path(const char *name)
+{
+  const char *rev_parse_argv[] = {
+    "git", "rev-parse", "--git-path", name, NULL
+  };
+  int fd;
+  pid_t pid = launch_git_argv(const_cast<char *const *>(rev_parse_argv), &fd);
 
-    current = head = tail = new_commit;
-  }
+  size_t len;
+  char *out = read_from_fd(fd, &len, PATH_MAX);
+  waitpid(pid, NULL, 0);
+  close(fd);
 
-  new_commit->commit_id = static_cast<char *>(xalloc(41));
-  memcpy(new_commit->commit_id, commit_id, 41);
-  new_commit->cached.state = commit_cached_state::PURGED;
+  if (!len || out[len - 1] != '\n')
+    return NULL;
 
-  return;
+  out[len - 1] = '\0';
+  return strdup(out);
 }
 
-static int show_prev_commit(char cmd)
+static void init_history_size(void)
 {
-  if (current == range_begin) {
-    bmprintf("begin of range...");
-    return 0;
+  char *info_dir = git_path("objects/info");
+
+  /*
+   * commits in the graph are counted only for the entire history of HEAD,
+   * its Bloom filters are used by the path filter in any case
+   */
+  if (info_dir && commit_graph_load(info_dir) && !git_has_log_args()) {
+    nr_history = commit_graph_nr_commits();
+    nr_history_estimated = true;
   }
+  free(info_dir);
 
-  if (!current->prev) {
-    read_commit();
-
-    if (!current->prev)
-      return 0;
-  }
+  history_count.pid = launch_git_rev_list("--count", &history_count.fd);
+  fcntl(history_count.fd, F_SETFL,
+	fcntl(history_count.fd, F_GETFL) | O_NONBLOCK);
+}
 
-  current = current->prev;
-  current->head_line = 0;
+static int history_count_pollfd(struct pollfd *pfd)
+{
+  pfd->fd = history_count.fd;
+  pfd->events = POLLIN;
+  pfd->revents = 0;
 
   return 1;
 }
 
-static int show_next_commit(char cmd)
+/* return 1 when the size of history is updated */
+static int history_count_handle_pollfd(struct pollfd *pfd)
 {
-  if (current == range_end) {
-    bmprintf("end of range...");
-    return 1;
+  if (!(pfd->revents & (POLLIN | POLLHUP)))
+    return 0;
+
+  ssize_t ret;
+  while ((ret = read(history_count.fd, history_count.buf + history_count.len,
+		     sizeof(history_count.buf) - 1 - history_count.len))) {
+    if (ret < 0) {
+      if (errno == EINTR)
+	continue;
+      if (errno == EAGAIN)
+	return 0;
+
+      die("read() failed\n");
+    }
+
+    history_count.len += ret;
+    if (history_count.len == sizeof(history_count.buf) - 1)
+      break;
   }
 
-  if (!current->next) {
-    assert(current == head);
+  waitpid(history_count.pid, NULL, 0);
+  close(history_count.fd);
+  history_count.fd = -1;
+
+  history_count.buf[history_count.len] = '\0';
+  long count = strtol(history_count.buf, NULL, 10);
+  if (!count)
+    return 0;
+
+  if (file_history_path) {
+    entire_history.nr_history = count;
+    entire_history.nr_history_estimated = false;
     return 0;
   }
 
-  current = current->next;
-  current->head_line = 0;
+  nr_history = count;
+  nr_history_estimated = false;
 
   return 1;
 }
 
-static int forward_line(char cmd)
-{
-  struct commit_cached *cached = get_cached(current);
-
-  if (current->head_line + row < cached->nr_lines) {
-    current->head_line++;
-    return 1;
-  }
-
-  return 0;
-}
+/*
+ * ticket stream: messages of the entire history are read in the background
+ * for indexing tickets of commits not loaded yet
+ */
+static struct {
+  pid_t pid;
+  int fd;
 
-static int backward_line(char cmd)
-{
-  if (0 < current->head_line) {
-    current->head_line--;
-    return 1;
-  }
+  bool done;
+} ticket_stream = { 0, -1, false };
 
-  return 0;
-}
+#define TICKET_STREAM_READ_SIZE (64 * 1024)
 
-static int goto_top(char cmd)
+static void ticket_stream_start(void)
 {
-  if (!current->head_line)
-    return 0;
+  if (ticket_stream.pid || ticket_stream.done)
+    return;
 
-  current->head_line = 0;
-  return 1;
+  ticket_stream.pid = launch_git_log_messages(&ticket_stream.fd);
+  fcntl(ticket_stream.fd, F_SETFL,
+	fcntl(ticket_stream.fd, F_GETFL) | O_NONBLOCK);
 }
 
-static int goto_bottom(char cmd)
+static int ticket_stream_pollfd(struct pollfd *pfd)
 {
-  struct commit_cached *cached = get_cached(current);
-
-  if (cached->nr_lines < row)
-    return 0;
+  pfd->fd = ticket_stream.fd;
+  pfd->events = POLLIN;
+  pfd->revents = 0;
 
-  current->head_line = cached->nr_lines - row;
   return 1;
 }
 
-static int forward_page(char cmd)
+static void ticket_stream_handle_pollfd(struct pollfd *pfd)
 {
-  struct commit_cached *cached = get_cached(current);
+  static char buf[TICKET_STREAM_READ_SIZE];
 
-  if (cached->nr_lines < current->head_line + row)
-    return 0;
+  if (!(pfd->revents & (POLLIN | POLLHUP)))
+    return;
 
-  current->head_line += row;
-  if (cached->nr_lines < current->head_line + row)
-    current->head_line = cached->nr_lines - row;
+  /* a chunk per iteration of the main loop for not blocking keys */
+  ssize_t ret = read(ticket_stream.fd, buf, sizeof(buf));
+  if (ret < 0) {
+    if (errno == EINTR || errno == EAGAIN)
+      return;
 
-  return 1;
-}
+    die("read() failed\n");
+  }
 
-static int backward_page(char cmd)
-{
-  if (!current->head_line)
-    return 0;
+  /* the index is shared with loads filling texts */
+  pthread_mutex_lock(&cache_lock);
+  if (ret)
+    ticket_stream_feed(buf, ret);
+  else
+    ticket_stream_end();
+  pthread_mutex_unlock(&cache_lock);
 
-  current->head_line -= row;
-  if (current->head_line < 0)
-    current->head_line = 0;
+  if (ret)
+    return;
 
-  return 1;
+  waitpid(ticket_stream.pid, NULL, 0);
+  close(ticket_stream.fd);
+  ticket_stream.fd = -1;
+  ticket_stream.done = true;
 }
 
-static struct commit *orig_before_visit_root;
-
-static int long_run_command_visit_root(void)
+static void ticket_stream_reset(void)
 {
-  if (!current->prev)
-    read_commit();
-
-  if (!current->prev) {
-    long_run_command = NULL;
-    return 1;
+  if (ticket_stream.fd != -1) {
+    kill(ticket_stream.pid, SIGKILL);
+    waitpid(ticket_stream.pid, NULL, 0);
+    close(ticket_stream.fd);
   }
 
-  current = current->prev;
-  return 0;
+  ticket_stream.pid = 0;
+  ticket_stream.fd = -1;
+  ticket_stream.done = false;
+
+  pthread_mutex_lock(&cache_lock);
+  ticket_index_clear();
+  pthread_mutex_unlock(&cache_lock);
 }
 
-static void long_run_command_compl_visit_root(bool stopped)
+/* 1 origin position of c in the history, 0 when unknown */
+static long history_position(struct commit *c)
 {
-  if (!stopped)
-    goto end;
+  if (0 <= c->log_idx)
+    return c->log_idx + 1;
 
-  current = orig_before_visit_root;
-  bmprintf("stop visiting root commit");
+  /* the root found before git log reaches it */
+  uint32_t pos;
+  if (nr_history < 0 || git_has_log_args()
+      || !commit_graph_lookup(c->commit_id, &pos))
+    return 0;
 
- end:
-  orig_before_visit_root = NULL;
-  memset(bottom_message, 0, bottom_message_size);
+  uint32_t gen = commit_graph_generation(pos);
+  if (!gen || nr_history < gen)
+    return 0;
 
-  long_run_command = NULL;
-  long_run_command_compl = NULL;
-  state_long_run = long_run::DEFAULT;
+  return nr_history - gen + 1;
 }
 
-static int show_root(char cmd)
-{
-  if (range_begin) {
-    current = range_begin;
-    return 1;
-  }
-
-  if (root) {
-    current = root;
-    current->head_line = 0;
-
-    return 1;
-  }
+static struct commit *last_shown;
 
-  orig_before_visit_root = current;
+/* a commit whose loading is canceled isn't loaded again until a key input */
+static struct commit *load_canceled;
 
-  assert(!long_run_command);
-  assert(!long_run_command_compl);
-  long_run_command = long_run_command_visit_root;
-  long_run_command_compl = long_run_command_compl_visit_root;
+static void update_terminal_loading(void)
+{
+  move(0, 0);
+  clear();
 
-  assert(state_long_run == long_run::DEFAULT);
-  state_long_run = long_run::RUNNING;
+  printw("commit %s\n\n", current->commit_id);
+  if (current == load_canceled)
+    printw("loading canceled, type any key to retry\n");
+  else
+    printw("loading... (type Esc or ^C to cancel)\n");
 
-  bmprintf("visiting root commit...");
-  return 1;
+  refresh();
 }
 
-static int show_head(char cmd)
+static int cancel_screen_load(void)
 {
-  if (current == head)
+  if (!screen_load.commit)
     return 0;
 
-  if (range_end)
-    current = range_end;
-  else
-    current = head;
+  load_cancel(&screen_load);
 
-  current->head_line = 0;
+  if (last_shown && last_shown != current)
+    current = last_shown;
+  else
+    load_canceled = current;
 
+  bmprintf("loading canceled");
   return 1;
 }
 
-#define QUERY_SIZE 128
-static char query[QUERY_SIZE + 1];
-static int query_used;
+/* display_reverse(): reverse cells of bytes [begin, end) of the line */
+static void display_reverse(struct display_line *d, cchar_t *cells,
+			    int nr_cells, int begin, int end)
+{
+  for (int k = 0; k < nr_cells; k++) {
+    if (d->offsets[k] < begin || end <= d->offsets[k])
+      continue;
 
-static bool (*match_filter)(char *);
+    wchar_t wcs[CCHARW_MAX + 1];
+    attr_t attr;
+    short pair;
 
-enum class match_type {
-  DEFAULT,
-  MODIFIED,
-  AT,
-  COMMIT_MESSAGE,
-  FILE,
-};
+    getcchar(&cells[k], wcs, &attr, &pair, NULL);
+    setcchar(&cells[k], wcs, attr | A_REVERSE, pair, NULL);
+  }
+}
 
-static match_type current_match_type = match_type::DEFAULT;
-static char *current_match_type_str(void)
+/* display_reverse_hits(): reverse hits of the query in line i */
+static void display_reverse_hits(struct commit_cached *cached, int i,
+				 struct display_line *d, cchar_t *cells,
+				 int nr_cells)
 {
-  string ret;
+  const char *line = cached->lines[i];
+  int len = line_len(cached, i);
+
+  if (current_search_type == search_type::REGEX) {
+    regmatch_t match;
+    int begin = 0;
+
+    while (begin < len) {
+      match.rm_so = begin;
+      match.rm_eo = len;
+      if (regexec(re_compiled, line, 1, &match,
+		  REG_STARTEND | REG_NOTEOL | (begin ? REG_NOTBOL : 0)))
+	break;
 
-  switch (current_match_type) {
-  case match_type::DEFAULT:
-    ret = "default";
-    break;
-  case match_type::MODIFIED:
-    ret = "modified";
-    break;
-  case match_type::AT:
-    ret = "at";
-    break;
-  case match_type::COMMIT_MESSAGE:
-    ret = "commit";
-    break;
-  case match_type::FILE:
-    ret = "file";
-    break;
-  default:
-    die("invalid match type: %d\n", current_match_type);
-    break;
-  };
+      display_reverse(d, cells, nr_cells, match.rm_so, match.rm_eo);
+      /* an empty match would be found again */
+      begin = max((int)match.rm_eo, (int)match.rm_so + 1);
+    }
 
-  return const_cast<char *>(ret.c_str());
-}
+    return;
+  }
 
-static bool match_filter_modified(char *line)
-{
-  return line[0] == '+' || line[0] == '-';
-}
+  assert(current_search_type == search_type::FTS);
 
-static bool match_filter_at(char *line)
-{
-  return line[0] == '@';
-}
+  for (int begin = 0; begin < len; begin++) {
+    for (int j = 0; j < nr_tokenized_query; j++) {
+      const char *q = tokenized_query[j];
+      int q_len = strlen(q);
 
-static bool match_filter_file(char *line)
-{
-  /* lines begin with "+++" or "---" */
-  if (strlen(line) < 3)
-    return false;
+      if (len - begin < q_len || strncmp(q, line + begin, q_len))
+	continue;
 
-  return !strncmp(line, "+++", 3) || !strncmp(line, "---", 3);
+      display_reverse(d, cells, nr_cells, begin, begin + q_len);
+      begin += q_len - 1;
+      break;
+    }
+  }
 }
 
-static bool match_filter_commit_message(char *line)
-{
-  /* TODO */
-  return true;
-}
+static const char *commit_filter_status(void);
+
+/* --bench-startup: quit at the first paint of a text */
+static bool bench_startup;
+static struct timespec startup_at, first_paint_at;
 
-static bool match_filter_default(char *line)
+static void print_startup_time(void)
 {
-  return true;
+  printf("first paint: %.1f ms\n",
+	 (first_paint_at.tv_sec - startup_at.tv_sec) * 1000.0
+	 + (first_paint_at.tv_nsec - startup_at.tv_nsec) / 1000000.0);
 }
 
-static int match_line(char *line)
+static void update_terminal_default(void)
 {
-  if (!match_filter(line))
-    return 0;
+  if (screen_load.commit && screen_load.commit != current)
+    load_cancel(&screen_load);
 
-  if (!regexec(re_compiled, line, 0, NULL, REG_NOTEOL))
-    return 1;
+  struct commit_cached *cached = screen_cached();
+  if (!cached) {
+    if (current != load_canceled)
+      load_start(&screen_load, current, true, load_compl_fill);
 
-  return 0;
-}
+    update_terminal_loading();
+    return;
+  }
 
-static int match_commit_regex(struct commit *c, int direction, int prog)
-{
-  int i = c->head_line;
-  int nli, result;
-  char *line;
+  move(0, 0);
+  clear();
 
-  struct commit_cached *cached = get_cached(c);
+  if (last_shown != current) {
+    if (last_shown)
+      release_cold_pages(last_shown);
+    last_shown = current;
+  }
 
-  if (prog) {
-    /* exclude current line */
+  int bm_len = strlen(bottom_message);
+  int nr_rows = min((int)row - !!bm_len,
+		    cached->nr_lines - current->head_line);
 
-    if (direction) {
-      if (cached->nr_lines <= i - 1)
-	return 0;
-    } else {
-      if (!i)
-	return 0;
+  for (int y = 0; y < nr_rows; y++) {
+    int i = current->head_line + y;
+    struct display_line *d = display_line_get(cached, i);
+    int nr_cells = display_fit(d, (int)col);
+
+    if (state != main_loop_state::SEARCHING_QUERY) {
+      mvadd_wchnstr(y, 0, d->cells, nr_cells);
+      continue;
     }
 
-    i += direction ? 1 : -1;
+    /* hits are reversed on a copy of the cells */
+    cchar_t cells[nr_cells + 1];
+    memcpy(cells, d->cells, nr_cells * sizeof(cchar_t));
+    display_reverse_hits(cached, i, d, cells, nr_cells);
+    mvadd_wchnstr(y, 0, cells, nr_cells);
   }
 
-  do {
-    line = cached->lines[i];
-    if (line == nullptr)
-      return 0;
+  move(row - !!bm_len, 0);
+  attron(A_REVERSE);
 
-    nli = ret_nl_index(line);
-    line[nli] = '\0';
-    result = match_line(line);
-    line[nli] = '\n';
+  char bm_buf[col + 1];	/* we are using C99 */
+  char *p = bm_buf;
+#define bm_buf_rest() (sizeof(bm_buf) - (p - bm_buf))
 
-    if (result) {
-      c->head_line = i;
-      return 1;
-    }
+  if (cached->nr_lines <= current->head_line + row)
+    snprintf(p, bm_buf_rest(), "100%%");
+  else
+    snprintf(p, bm_buf_rest(), "% .0f%%",
+	     (float)(current->head_line + row)
+	     / cached->nr_lines * 100.0);
+  p += strlen(p);
 
-    i += direction ? 1 : -1;
-  } while (direction ? i < cached->nr_lines : 0 <= i);
+  if (current->head_line + row < cached->nr_lines)
+    snprintf(p, bm_buf_rest(), " (%d/%d)",
+	     current->head_line + row, cached->nr_lines);
+  else
+    snprintf(p, bm_buf_rest(), " (%d/%d)",
+	     cached->nr_lines, cached->nr_lines);
+  p += strlen(p);
 
-  return 0;
-}
+  if (file_history_path) {
+    snprintf(p, bm_buf_rest(), "   [%s]", file_history_path);
+    p += strlen(p);
+  }
 
-static int match_commit(struct commit *c, int direction, int prog)
-{
-  return match_commit_regex(c, direction, prog);
-}
+  snprintf(p, bm_buf_rest(), "%s", commit_filter_status());
+  p += strlen(p);
 
-static int current_direction, current_global;
+  if (cached->level != diff_level::FULL) {
+    snprintf(p, bm_buf_rest(), "   [%s, D: full diff]",
+	     cached->level == diff_level::STAT ? "stat only" : "no renames");
+    p += strlen(p);
+  }
 
-#define update_query_bm()	do {				\
-    bmprintf("%s %s search (filter: %s, type: %s): %s",		\
-	     current_direction ? "forward" : "backward",	\
-	     current_global ? "global" : "local",		\
-	     current_match_type_str(),				\
-	     current_search_type == search_type::REGEX ?		\
-	     "regex" : "FTS",					\
-	     query);						\
-								\
-  } while (0)
+  long pos = history_position(current);
+  if (pos) {
+    snprintf(p, bm_buf_rest(), "   commit %ld", pos);
+    p += strlen(p);
+  }
 
-static bool search_found;
-static struct commit *orig_before_do_search;
-static void long_run_command_compl_do_search(bool stopped)
-{
-  if (search_found)
-    goto end;
+  if (pos && 0 < nr_history) {
+    snprintf(p, bm_buf_rest(), " of %s%ld",
+	     nr_history_estimated ? "~" : "", nr_history);
+    p += strlen(p);
+  }
 
-  if (!stopped) {
-    if (!search_found)
-      bmprintf("not found: %s", query);
+  snprintf(p, bm_buf_rest(), "   ");
+  p += strlen(p);
 
-    goto restore;
+  for (int i = 0; i < 8; i++) {
+    snprintf(p, bm_buf_rest(), "%c",
+	     current->commit_id[i]);
+    p += strlen(p);
   }
+  snprintf(p, bm_buf_rest(), ": ");
+  p += strlen(p);
 
-  bmprintf("search stopped");
+  char summary[81];
+  snprintf(summary, 80, "%s", current->summary);
+  snprintf(p, bm_buf_rest(), "%s", summary);
+  p += strlen(p);
+#undef bm_buf_rest
 
- restore:
-  current = orig_before_do_search;
+  printw("%s", bm_buf);
 
- end:
-  search_found = false;
-  orig_before_do_search = NULL;
+  if (bm_len) {
+    move(row, 0);
+    printw("%s", bottom_message);
+  }
+
+  attroff(A_REVERSE);
+
+  refresh();
+
+  /* the main loop ends, the workers are stopped before exit */
+  if (bench_startup && running) {
+    clock_gettime(CLOCK_MONOTONIC, &first_paint_at);
+    running = false;
+  }
 }
 
-static int long_run_command_do_search(void)
-{
-  int result = 0;
+struct help_str {
+  char cmd;
+  char *desc;
+};
 
-  result = match_commit(current, current_direction, 0);
-  if (result) {
-    if (current_search_type == search_type::FTS)
-      current->head_line = 0;
+struct help_str help_str_array[] = {
+#define cmd(cmd, func, desc) { cmd, static_cast<char *>(const_cast<char *>(desc)) },
+#include "default_cmd.def"
+#undef cmd
+  { '\0', NULL }
+};
 
-    search_found = true;
+/*
+ * the help scrolls like the commit list, it is longer than a terminal.
+ * digits of the count prefix are shown as one entry.
+ */
+static int help_head;
 
-    return 1;
+#define help_is_digit(i) ('1' <= help_str_array[i].cmd		\
+			  && help_str_array[i].cmd <= '9')
+
+static int help_nr_entries(void)
+{
+  int nr = 0;
+
+  for (int i = 0; help_str_array[i].cmd != '\0'; i++) {
+    if (!help_is_digit(i))
+      nr++;
   }
 
-  if (current_direction) {
-    if (current == range_begin)
-      goto not_found;
+  return nr;
+}
 
-    if (!current->prev)
-      read_commit();
+/* help_rows(): entries shown at once, below the title */
+#define help_rows() max((int)row - 2, 1)
 
-    if (current->prev)
-      current = current->prev;
-    else
-      goto not_found;
-  } else {
-    if (current == range_end)
-      goto not_found;
+static void update_terminal_help(void)
+{
+  int i, nth = 0, shown = 0;
 
-    if (current->next)
-      current = current->next;
-    else
-      goto not_found;
+  move(0, 0);
 
-    current->head_line = get_cached(current)->nr_lines - 1;
-  }
+  printw("keystrokes supported in default state (j/k, J/K: scroll, q: quit)\n\n");
+  for (i = 0; help_str_array[i].cmd != '\0' && shown < help_rows(); i++) {
+    if (help_is_digit(i) || nth++ < help_head)
+      continue;
 
-  return 0;
+    if (help_str_array[i].cmd == '0')
+      printw("0-9: %s\n", help_str_array[i].desc);
+    else
+      printw("%c: %s\n", help_str_array[i].cmd, help_str_array[i].desc);
+    shown++;
+  }
 
- not_found:
-  bmprintf("not found: %s", query);
-  search_found = false;
+  while (shown++ < help_rows())
+    addch('\n');
 
-  return 1;
+  refresh();
 }
 
-static int do_search(int direction, int global, int prog)
+static int help_scroll(int delta)
 {
-  int result;
+  int dest = help_head + delta;
 
-  result = match_commit(current, direction, prog);
-  if (result)
-    return 1;
-  if (!global)
+  dest = min(dest, help_nr_entries() - help_rows());
+  dest = max(dest, 0);
+
+  if (dest == help_head)
     return 0;
 
-  orig_before_do_search = current;
+  help_head = dest;
+  return 1;
+}
 
-  if (direction) {
-    if (current == range_begin)
-      return 0;
+static int help_input(char cmd)
+{
+  switch (cmd) {
+  case 'j':
+    return help_scroll(1);
+  case 'k':
+    return help_scroll(-1);
+  case ' ':
+  case 'J':
+    return help_scroll(help_rows());
+  case 'K':
+    return help_scroll(-help_rows());
+  case 'q':
+    state = main_loop_state::DEFAULT;
+    return 1;
+  default:
+    return 0;
+  }
+}
 
-    if (!current->prev)
-      read_commit();
+static int changed_files_cursor;
 
-    if (current->prev)
-      current = current->prev;
-    else
-      return 0;
-  } else {
-    if (current == range_end)
-      return 0;
+static void update_terminal_show_changed_files(void)
+{
+  move(0, 0);
 
-    if (current->next)
-      current = current->next;
-    else
-      return 0;
+  printw("files changed in this commit:\n");
 
-    current->head_line = get_cached(current)->nr_lines - 1;
+  int i;
+  for (i = 0; i < current->nr_file_list; i++) {
+    if (i == changed_files_cursor)
+      attron(A_REVERSE);
+    printw(" %s", path_name(current->file_list[i]));
+    if (i == changed_files_cursor)
+      attroff(A_REVERSE);
+    addch('\n');
   }
 
-  current_direction = direction;
-  current_global = global;
-
-  assert(!long_run_command);
-  assert(!long_run_command_compl);
-  long_run_command = long_run_command_do_search;
-  long_run_command_compl = long_run_command_compl_do_search;
-
-  assert(state_long_run == long_run::DEFAULT);
-  state_long_run = long_run::RUNNING;
-  search_found = false;
+  while (i++ < row - 1)
+    addch('\n');
 
-  return -1;
+  printw("j/k: select, enter: follow the file through history, q: quit\n");
+  refresh();
 }
 
-static struct {
-  struct commit *commit;
-  int head_line;
-} orig_place;
+struct commit_list_row {
+  char *commit_id, *author, *date, *summary;
+};
 
-static void tokenize_query(void)
+#define COMMIT_LIST_INIT_SIZE 1024
+static struct commit_list_row *commit_list;
+static int nr_commit_list, commit_list_size;
+static int commit_list_head, commit_list_cursor;
+static FILE *commit_list_stream;
+static pid_t commit_list_pid;
+static bool commit_list_read_end;
+
+static void read_commit_list(int nr)
+/* read rows from the summary stream until commit_list has nr rows */
 {
-  static char *duped_query;
+  if (!commit_list_stream) {
+    int fd;
+
+    commit_list_pid = launch_git_log_summary(&fd);
+    commit_list_stream = fdopen(fd, "r");
+    if (!commit_list_stream)
+      die("fdopen() failed\n");
+
+    commit_list_size = COMMIT_LIST_INIT_SIZE;
+    commit_list = static_cast<struct commit_list_row *>(xalloc(commit_list_size * sizeof(struct commit_list_row)));
+    mem_add(mem_category::COMMIT_LIST,
+	    commit_list_size * sizeof(struct commit_list_row));
+  }
 
-  if (duped_query)
-    free(duped_query);
+  while (!commit_list_read_end && nr_commit_list < nr) {
+    char *line = NULL;
+    size_t n = 0;
 
-  duped_query= strdup(query);
-  if (!duped_query)
-    die("strdup() failed\n");
+    ssize_t len = getline(&line, &n, commit_list_stream);
+    if (len <= 0) {
+      free(line);
+      commit_list_read_end = true;
+      break;
+    }
 
-  if (!tokenized_query) {
-    nr_tokenized_query = 0;
-    tokenized_query_size = 1;
-    tokenized_query = static_cast<char **>(xalloc(tokenized_query_size * sizeof(char *)));
-  }
+    if (line[len - 1] == '\n')
+      line[len - 1] = '\0';
+
+    struct commit_list_row *r = &commit_list[nr_commit_list];
+    char *saveptr = line;
+    r->commit_id = strsep(&saveptr, "\x1f");
+    r->author = strsep(&saveptr, "\x1f");
+    r->date = strsep(&saveptr, "\x1f");
+    r->summary = strsep(&saveptr, "\x1f");
+    if (!r->summary) {
+      /* malformed line, never expected */
+      free(line);
+      continue;
+    }
 
-  char *saveptr;
-  tokenized_query[0] = strtok_r(duped_query, " ", &saveptr);
-  nr_tokenized_query = 1;
+    mem_add(mem_category::COMMIT_LIST, n);
 
-  char *next_token;
-  while ((next_token = strtok_r(NULL, " ", &saveptr))) {
-    if (nr_tokenized_query == tokenized_query_size) {
-      tokenized_query_size *= 2;
-      tokenized_query =
-	static_cast<char **>(xrealloc(tokenized_query, tokenized_query_size * sizeof(char *)));
+    if (++nr_commit_list == commit_list_size) {
+      mem_add(mem_category::COMMIT_LIST,
+	      commit_list_size * sizeof(struct commit_list_row));
+      commit_list_size <<= 1;
+      commit_list = static_cast<struct commit_list_row *>(xrealloc(commit_list,
+								    commit_list_size * sizeof(struct commit_list_row)));
     }
-
-    tokenized_query[nr_tokenized_query++] = next_token;
   }
 }
 
-static int _search(int key, int direction, int global)
+static void commit_list_reset(void)
 {
-  current_direction = direction;
-  current_global = global;
+  if (!commit_list_stream)
+    return;
 
-  switch (state) {
-  case main_loop_state::DEFAULT:
-  case main_loop_state::SEARCHING_QUERY:
-    current_match_type = match_type::DEFAULT;
-    match_filter = match_filter_default;
+  /* a row points the head of its line */
+  for (int i = 0; i < nr_commit_list; i++)
+    free(commit_list[i].commit_id);
+  free(commit_list);
+  commit_list = NULL;
+  fclose(commit_list_stream);
+  commit_list_stream = NULL;
+  kill(commit_list_pid, SIGKILL);
+  waitpid(commit_list_pid, NULL, 0);
+
+  mem_sub(mem_category::COMMIT_LIST, mem_get(mem_category::COMMIT_LIST));
+  nr_commit_list = commit_list_size = 0;
+  commit_list_head = commit_list_cursor = 0;
+  commit_list_read_end = false;
+}
 
-  case main_loop_state::INPUT_SEARCH_DIRECTION:
-    query_used = 0;
-    bzero(query, QUERY_SIZE);
+static void update_terminal_show_commit_list(void)
+{
+  move(0, 0);
+  clear();
 
-    bmprintf("%s %s search (filter: %s, type: %s): ",
-	     current_direction ? "forward" : "backward",
-	     current_global ? "global" : "local",
-	     current_match_type_str(),
-	     current_search_type == search_type::REGEX ? "regex" : "FTS");
+  read_commit_list(commit_list_head + row);
 
-    state = main_loop_state::INPUT_SEARCH_QUERY;
+  int i;
+  for (i = commit_list_head;
+       i < commit_list_head + (int)row && i < nr_commit_list; i++) {
+    struct commit_list_row *r = &commit_list[i];
 
-    break;
+    if (i == commit_list_cursor)
+      attron(A_REVERSE);
 
-  case main_loop_state::INPUT_SEARCH_QUERY:
-    if (query_used + 1 == QUERY_SIZE) {
-      bmprintf("search query is too long!");
-      state = main_loop_state::DEFAULT;
+    char buf[col + 1];
+    snprintf(buf, col + 1, "%.8s %s %-16.16s %s",
+	     r->commit_id, r->date, r->author, r->summary);
+    printw("%s", buf);
 
-      goto end;
-    }
+    if (i == commit_list_cursor)
+      attroff(A_REVERSE);
 
-    if (key == 0xd /* FIXME: \n ?*/) {
-      state = main_loop_state::SEARCHING_QUERY;
+    addch('\n');
+  }
 
-      orig_place.commit = current;
-      orig_place.head_line = current->head_line;
+  while (i++ < commit_list_head + (int)row)
+    addch('\n');
 
-      if (current_search_type == search_type::FTS)
-	tokenize_query();
+  move(row, 0);
+  attron(A_REVERSE);
+  printw("commit list (%d/%d%s), enter: show, q: quit",
+	 commit_list_cursor + 1, nr_commit_list,
+	 commit_list_read_end ? "" : "+");
+  attroff(A_REVERSE);
 
-    } else {
-      query[query_used++] = (char)key;
-      update_query_bm();
-    }
-  end:
-    break;
+  refresh();
+}
 
-  default:
-    die("invalid or unknown state: %d", state);
-    break;
-  }
 
-  if (state == main_loop_state::SEARCHING_QUERY) {
-    if (current_search_type == search_type::REGEX) {
-      if (re_compiled)
-	regfree(re_compiled);
-      else
-	re_compiled = static_cast<regex_t *>(xalloc(sizeof(regex_t)));
-      regcomp(re_compiled, query, REG_ICASE);
-    } else {
-      assert(current_search_type == search_type::FTS);
-    }
+static void update_terminal(void)
+{
+  switch (state) {
+  case main_loop_state::DEFAULT:
+  case main_loop_state::INPUT_SEARCH_QUERY:
+  case main_loop_state::SEARCHING_QUERY:
+  case main_loop_state::INPUT_SEARCH_FILTER:
+  case main_loop_state::INPUT_SEARCH_FILTER2:
+  case main_loop_state::INPUT_SEARCH_DIRECTION:
+  case main_loop_state::LAUNCH_GIT_COMMAND:
+  case main_loop_state::READ_BRANCHNAME_FOR_CHECKOUT:
+  case main_loop_state::INPUT_COMMIT_FILTER:
+    update_terminal_default();
+    break;
 
-    int result = do_search(direction, global, 0);
-    switch (result) {
-    case 0:
-      bmprintf("not found: %s", query);
-      break;
-    case 1:
-      update_query_bm();
-      break;
-    case -1:	/* do nothing, continue */
-      assert(state_long_run == long_run::RUNNING);
-      return 0;
-    default:
-      die("invalid return value from do_search(): %d\n", result);
-      break;
-    }
-  }
+  case main_loop_state::SHOW_CHANGED_FILES:
+    update_terminal_show_changed_files();
+    break;
 
-  return 1;
-}
+  case main_loop_state::SHOW_COMMIT_LIST:
+    update_terminal_show_commit_list();
+    break;
 
-static int search(int direction, int global)
-{
-  return _search(-1, direction, global);
+  case main_loop_state::HELP:
+    update_terminal_help();
+    break;
+
+  default:
+    die("unknown state: %d\n", state);
+    break;
+  };
 }
 
-static int search_global_forward(char cmd)
+static void signal_handler(int signum)
 {
-  current_search_type = search_type::REGEX;
-  return search(1, 1);
+  switch (signum) {
+  case SIGWINCH:
+    update_row_col();
+    update_terminal();
+    break;
+
+  case SIGINT:
+    if (jobs_foreground())
+      jobs_stop_foreground();
+    else if (cancel_screen_load())
+      update_terminal();
+    break;
+
+  default:
+    die("unknown signal: %d", signum);
+    break;
+  }
 }
 
-static int search_global_backward(char cmd)
+static int init_signalfd(void)
 {
-  current_search_type = search_type::REGEX;
-  return search(0, 1);
+  sigset_t mask;
+  int sigfd;
+
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGWINCH);
+  sigaddset(&mask, SIGINT);
+  sigprocmask(SIG_BLOCK, &mask, NULL);
+
+  sigfd = signalfd(-1, &mask, SFD_NONBLOCK);
+  if (sigfd < 0) {
+    fprintf(stderr, "signalfd() failed: %s\n",
+	    strerror(errno));
+    exit(1);
+  }
+
+  return sigfd;
 }
 
-static int search_local_forward(char cmd)
+static bool read_end;
+static int nr_read_commits;
+
+/*
+ * root is found with git rev-list before git log reaches it. until then, it
+ * is detached from the list of read commits.
+ */
+#define root_detached() (root && root != head && !root->next)
+
+/*
+ * log records: a line per commit from git log, ID, committer date, parents
+ * and author separated with 0x1f. the output is buffered in a log_buf for
+ * each chain.
+ */
+#define LOG_BUF_INIT_SIZE (64 * 1024)
+
+struct log_buf {
+  char *data;
+  size_t size, pos, len;
+};
+
+/* log_buf of stdin_fd */
+static struct log_buf *log_buf;
+
+struct log_record {
+  char commit_id[41];	/* with '\0' */
+  unsigned int date;
+  int nr_parents;
+  const char *author;	/* valid until the next record is read */
+};
+
+static struct log_buf *alloc_log_buf(void)
 {
-  current_search_type = search_type::REGEX;
-  return search(1, 0);
+  struct log_buf *b = static_cast<struct log_buf *>(xalloc(sizeof(*b)));
+
+  b->size = LOG_BUF_INIT_SIZE;
+  b->data = static_cast<char *>(xalloc(b->size));
+
+  return b;
 }
 
-static int search_local_backward(char cmd)
+static void free_log_buf(struct log_buf *b)
 {
-  current_search_type = search_type::REGEX;
-  return search(0, 0);
+  free(b->data);
+  free(b);
 }
 
-static int search_progress(char cmd)
+static void parse_log_record(char *line, struct log_record *r)
 {
-  if (state != main_loop_state::SEARCHING_QUERY)
-    return 0;
+  char *fields[4] = { line, };
+  for (int i = 1; i < 4; i++) {
+    fields[i] = fields[i - 1] ? strchr(fields[i - 1], 0x1f) : NULL;
+    if (fields[i])
+      *fields[i]++ = '\0';
+  }
 
-  assert(cmd == 'n' || cmd == 'p');
+  snprintf(r->commit_id, sizeof(r->commit_id), "%s", fields[0]);
+  r->date = fields[1] ? strtoul(fields[1], NULL, 10) : 0;
 
-  int res = do_search(cmd == 'n' ? 1 : 0, current_global, 1);
-  switch (res) {
-  case 0:
-    bmprintf("not found: %s", query);
-  case 1:
-    return 1;
-  case -1:
-    update_query_bm();
-    return 0;
-  default:
-    die("invalid return value of do_search(): %d", res);
-    return 0;	/* suppress compiler warning */
+  r->nr_parents = 0;
+  if (fields[2] && *fields[2]) {
+    r->nr_parents = 1;
+    for (char *p = fields[2]; *p; p++)
+      r->nr_parents += *p == ' ';
   }
+
+  r->author = fields[3] ? fields[3] : "";
 }
 
-static int input_query(char key)
+/*
+ * read_log_record(): read a record from fd through b. return false if no
+ * record is read, *end is set at the end of the output.
+ */
+static bool read_log_record(int fd, struct log_buf *b, struct log_record *r,
+			    bool *end)
 {
-  if (key == (char)0x7f) {
-    /* backspace */
-    if (!query_used)
-      return 0;
+  char *line;
 
-    query[--query_used] = '\0';
-    update_query_bm();
+  *end = false;
 
-    return 1;
-  } else if (key == (char)0x1b) {
-    /* escape */
-    if (current_search_type == search_type::REGEX
-	&& re_compiled) {
-      regfree(re_compiled);
-      free(re_compiled);
-      re_compiled = NULL;
+  while (1) {
+    char *nl = static_cast<char *>(memchr(b->data + b->pos, '\n',
+					  b->len - b->pos));
+    if (nl) {
+      *nl = '\0';
+      line = b->data + b->pos;
+      b->pos = nl - b->data + 1;
+      break;
     }
 
-    query_used = 0;
-    bzero(query, QUERY_SIZE);
+    /* a partial record is moved to the front, a long one grows the buffer */
+    memmove(b->data, b->data + b->pos, b->len - b->pos);
+    b->len -= b->pos;
+    b->pos = 0;
 
-    bzero(bottom_message, bottom_message_size);
-    state = main_loop_state::DEFAULT;
-    return 1;
+    if (b->size - 1 <= b->len) {
+      b->size <<= 1;
+      b->data = static_cast<char *>(xrealloc(b->data, b->size));
+    }
+
+    ssize_t ret = read(fd, b->data + b->len, b->size - 1 - b->len);
+    if (ret < 0) {
+      if (errno == EINTR)
+	continue;
+
+      die("read() failed\n");
+    }
+
+    if (!ret) {
+      *end = true;
+      if (!b->len)
+	return false;
+
+      /* the last record without a newline */
+      b->data[b->len] = '\0';
+      line = b->data;
+      b->pos = b->len;
+      break;
+    }
+
+    b->len += ret;
   }
 
-  return _search(key, current_direction, current_global);
+  parse_log_record(line, r);
+  return true;
 }
 
-static int restore_orig_place(char cmd)
-{
-  if (!orig_place.commit)
-    return 0;
+/*
+ * author table: commits refer to interned authors with indexes, filters
+ * compare each author once
+ */
+static vector<string> authors;
+static unordered_map<string, int> author_indexes;
 
-  current = orig_place.commit;
-  current->head_line = orig_place.head_line;
+static int intern_author(const char *author)
+{
+  auto it = author_indexes.find(author);
+  if (it != author_indexes.end())
+    return it->second;
 
-  bmprintf("restored  original place");
+  authors.push_back(author);
+  author_indexes[author] = authors.size() - 1;
 
-  return 1;
+  return authors.size() - 1;
 }
 
-static int save_orig_place(char cmd)
+static struct commit *alloc_commit(const char *commit_id)
 {
-  orig_place.commit = current;
-  orig_place.head_line = current->head_line;
+  struct commit *c = static_cast<struct commit *>(xalloc(sizeof(*c)));
+  mem_add(mem_category::NODE, sizeof(*c));
 
-  bmprintf("saved current as original place");
+  memcpy(c->commit_id, commit_id, 41);
+  c->cached.state = commit_cached_state::PURGED;
+  c->author = -1;
 
-  return 1;
+  return c;
 }
 
-static int nop(char cmd)
+static void set_commit_metadata(struct commit *c, const struct log_record *r)
 {
-  return 0;
+  c->author = intern_author(r->author);
+  c->date = r->date;
+  c->nr_parents = min(r->nr_parents, (int)UCHAR_MAX);
 }
 
-static struct commit* get_prev_or_current(struct commit *c)
+static void read_commit(void)
 {
-  if (c->prev)
-    return c->prev;
-  else {
-    read_commit();
-    if (c->prev)
-      return c->prev;
+  if (read_end)
+    return;
+
+  struct log_record record;
+  bool end;
+  bool read = read_log_record(stdin_fd, log_buf, &record, &end);
+
+  if (end) {
+    read_end = true;
+
+    /* the size of history is known exactly once git log ends */
+    nr_history = nr_read_commits + read;
+    nr_history_estimated = false;
+
+    if (!read)
+      return;
   }
 
-  /* hmm... */
-  return c;
+  struct commit *new_commit;
+
+  if (root_detached() && !strcmp(root->commit_id, record.commit_id))
+    new_commit = root;
+  else
+    new_commit = alloc_commit(record.commit_id);
+
+  set_commit_metadata(new_commit, &record);
+  new_commit->log_idx = nr_read_commits++;
+
+  if (tail) {
+    assert(!tail->prev);
+
+    tail->prev = new_commit;
+    new_commit->next = tail;
+    tail = new_commit;
+  } else {
+    /* very unlikely */
+    assert(!head && !tail);
+
+    current = head = tail = new_commit;
+  }
+
+  return;
 }
 
-static int git_format_patch(bool force)
+static void find_root(void)
 {
-  struct commit *begin = range_begin;
+  int fd;
+  pid_t pid = launch_git_rev_list("--max-parents=0", &fd);
 
-  if (!begin)
-    begin = current;
+  size_t len;
+  char *out = read_from_fd(fd, &len, SIZE_MAX);
+  waitpid(pid, NULL, 0);
+  close(fd);
 
-  if (!range_end)
-    range_end = head;
+  /* roots are in reverse chronological order, the oldest one comes last */
+  if (len < 41 || out[len - 1] != '\n')
+    return;
 
-  struct commit *prev_begin = get_prev_or_current(begin);
+  char *root_id = out + len - 41;
+  root_id[40] = '\0';
 
-  char range[83];
-  sprintf(range, "%s..%s", prev_begin->commit_id, range_end->commit_id);
-  range[82] = '\0';
+  for (struct commit *p = tail; p; p = p->next) {
+    if (!strcmp(p->commit_id, root_id)) {
+      root = p;
+      return;
+    }
+  }
 
-  int ret;
-  char key = ' ';
-  bool retry = false;
- retry_cover_letter:
-  bool need_cover_letter = false;
-  move(row, 0);
-  for (int i = 0; i < col; i++) printw(" ");
-  move(row, 0);
-  printw("%s%c need cover letter? (y/N): ", retry ? "invalid char: " : "", key);
-  refresh();
+  root = alloc_commit(root_id);
+  root->log_idx = -1;
+}
 
-  ret = read(tty_fd, &key, 1);
-  if (ret != 1)
-    die("read() failed");
-  switch (key) {
-  case 'y':
-  case 'Y':
-    need_cover_letter = true;
-    break;
-  case 'n':
-  case 'N':
+#define FILL_HISTORY_BATCH 4096
+
+static struct commit *orig_before_fill_history;
+static int show_next_commit(char cmd);
+
+static int fill_history_step(void)
+{
+  for (int i = 0; i < FILL_HISTORY_BATCH; i++) {
+    if (!root_detached() || read_end)
+      return 1;
+
+    read_commit();
+  }
+
+  bmprintf("reading history until root... (%d commits)", nr_read_commits);
+  return 0;
+}
+
+static void fill_history_compl(bool stopped)
+{
+  if (stopped)
+    bmprintf("stop reading history");
+  else if (root_detached())
+    bmprintf("root commit isn't reachable from HEAD by git log");
+  else {
+    memset(bottom_message, 0, bottom_message_size);
+
+    if (current == orig_before_fill_history)
+      show_next_commit('l');
+  }
+
+  orig_before_fill_history = NULL;
+}
+
+static struct job fill_history_job = {
+  "reading history until root", job_prio::SCREEN, true,
+  fill_history_step, fill_history_compl,
+};
+
+/*
+ * commit filter: h and l skip commits whose metadata doesn't match. it is
+ * input like "author:alice since:2024-01-01 until:2024-06-30 no-merges",
+ * values with spaces are quoted like author:"Alice Smith".
+ * path:dir/file limits them to commits changing the path (relative to the
+ * top directory): the changed-path Bloom filters of the commit graph rule out
+ * most of the others without loading, the rest is checked with its diff.
+ */
+#define COMMIT_FILTER_SIZE 128
+
+static struct {
+  char input[COMMIT_FILTER_SIZE + 1];
+  int input_used;
+
+  /* spec: the applied filter, empty if none */
+  char spec[COMMIT_FILTER_SIZE + 1];
+  char author[COMMIT_FILTER_SIZE + 1];
+  unsigned int since, until;
+  int merges;			/* 1: merges only, -1: no merges, 0: both */
+  char path[COMMIT_FILTER_SIZE + 1];
+
+  /* results for the author table, -1 if not compared yet */
+  vector<signed char> author_matched;
+} commit_filter;
+
+#define commit_filter_active() (commit_filter.spec[0] != '\0')
+
+static const char *commit_filter_status(void)
+{
+  static char buf[COMMIT_FILTER_SIZE + 16];
+
+  buf[0] = '\0';
+  if (commit_filter_active())
+    snprintf(buf, sizeof(buf), "   [filter: %s]", commit_filter.spec);
+
+  return buf;
+}
+
+/* commit_filter_bloom(): false if c definitely doesn't change the path */
+static bool commit_filter_bloom(struct commit *c)
+{
+  uint32_t pos;
+
+  if (!commit_filter.path[0] || !commit_graph_lookup(c->commit_id, &pos))
+    return true;
+
+  return commit_graph_bloom_maybe(pos);
+}
+
+/*
+ * diff_line_has_path(): a path of "diff --git a/... b/..." is or is under
+ * path. the line of line_len bytes isn't NUL terminated, workers can scan it.
+ */
+static bool diff_line_has_path(const char *line, int line_len,
+			       const char *path)
+{
+  size_t len = strlen(path);
+  const char *end = line + line_len;
+
+  for (const char *p = line;
+       (p = static_cast<const char *>(memmem(p, end - p, path, len))); p++) {
+    if (p - line < 3 || (memcmp(p - 3, " a/", 3) && memcmp(p - 3, " b/", 3)))
+      continue;
+
+    if (p + len == end || p[len] == ' ' || p[len] == '/')
+      return true;
+  }
+
+  return false;
+}
+
+/*
+ * commit_filter_path(): c changes the path of the filter, checked with the
+ * text. callers load it beforehand, cache_pin() would block the main loop.
+ * reduced diffs don't have the headers and are taken as changing it, so are
+ * merges: git show gives a combined diff or none for them. their Bloom
+ * filters are computed against the first parent and still rule them out.
+ */
+static bool commit_filter_path(struct commit *c)
+{
+  if (!commit_filter.path[0] || 1 < c->nr_parents)
+    return true;
+
+  struct commit_cached *cached = cache_pin(c);
+  bool changed = cached->level == diff_level::STAT;
+
+  for (int i = 0; !changed && i < cached->nr_lines; i++) {
+    if (cached->line_classes[i] == line_class::FILE_HEADER
+	&& !strncmp(cached->lines[i], "diff --git ", 11))
+      changed = diff_line_has_path(cached->lines[i], line_len(cached, i),
+				   commit_filter.path);
+  }
+
+  cache_unpin(c);
+
+  return changed;
+}
+
+/* commit_filter_match(): c matches the filter as far as known without loading */
+static bool commit_filter_match(struct commit *c)
+{
+  if (!commit_filter_active())
+    return true;
+
+  if (!commit_filter_bloom(c))
+    return false;
+
+  if (c->author < 0)
+    return true;
+
+  if (commit_filter.merges
+      && (commit_filter.merges == 1) != (1 < c->nr_parents))
+    return false;
+
+  if (c->date < commit_filter.since || commit_filter.until < c->date)
+    return false;
+
+  if (!commit_filter.author[0])
+    return true;
+
+  if ((int)commit_filter.author_matched.size() <= c->author)
+    commit_filter.author_matched.resize(authors.size(), -1);
+
+  signed char *matched = &commit_filter.author_matched[c->author];
+  if (*matched < 0)
+    *matched = !!strcasestr(authors[c->author].c_str(), commit_filter.author);
+
+  return *matched;
+}
+
+/* parse_filter_date(): the beginning of date YYYY-MM-DD in local time */
+static bool parse_filter_date(const char *date, unsigned int *t)
+{
+  struct tm tm;
+
+  memset(&tm, 0, sizeof(tm));
+  const char *end = strptime(date, "%Y-%m-%d", &tm);
+  if (!end || *end)
+    return false;
+
+  tm.tm_isdst = -1;
+  time_t ret = mktime(&tm);
+  if (ret < 0)
+    return false;
+
+  *t = ret;
+  return true;
+}
+
+/*
+ * commit_filter_token(): the next space separated token of *input, NULL at
+ * the end. spaces in double quotes are kept, like author:"First Last", the
+ * quotes are removed.
+ */
+static char *commit_filter_token(char **input)
+{
+  char *p = *input, *tok, *out;
+  bool quoted = false;
+
+  while (*p == ' ')
+    p++;
+  if (!*p)
+    return NULL;
+
+  tok = out = p;
+  for (; *p && (quoted || *p != ' '); p++) {
+    if (*p == '"')
+      quoted = !quoted;
+    else
+      *out++ = *p;
+  }
+
+  *input = *p ? p + 1 : p;
+  *out = '\0';
+  return tok;
+}
+
+static bool commit_filter_parse(char *input)
+{
+  char author[COMMIT_FILTER_SIZE + 1] = "";
+  unsigned int since = 0, until = UINT_MAX;
+  int merges = 0;
+  char path[COMMIT_FILTER_SIZE + 1] = "";
+
+  for (char *tok = commit_filter_token(&input); tok;
+       tok = commit_filter_token(&input)) {
+    if (!strncmp(tok, "author:", 7))
+      snprintf(author, sizeof(author), "%s", tok + 7);
+    else if (!strncmp(tok, "since:", 6)) {
+      if (!parse_filter_date(tok + 6, &since))
+	return false;
+    } else if (!strncmp(tok, "until:", 6)) {
+      /* the whole day is included */
+      if (!parse_filter_date(tok + 6, &until))
+	return false;
+      until += 24 * 60 * 60 - 1;
+    } else if (!strcmp(tok, "merges"))
+      merges = 1;
+    else if (!strcmp(tok, "no-merges"))
+      merges = -1;
+    else if (!strncmp(tok, "path:", 5)) {
+      const char *p = tok + 5;
+
+      while (!strncmp(p, "./", 2))
+	p += 2;
+      snprintf(path, sizeof(path), "%s", p);
+
+      size_t len = strlen(path);
+      while (len && path[len - 1] == '/')
+	path[--len] = '\0';
+      if (!len)
+	return false;
+    } else
+      return false;
+  }
+
+  strcpy(commit_filter.author, author);
+  commit_filter.since = since;
+  commit_filter.until = until;
+  commit_filter.merges = merges;
+  strcpy(commit_filter.path, path);
+  commit_graph_set_bloom_path(path[0] ? path : NULL);
+  commit_filter.author_matched.clear();
+
+  return true;
+}
+
+static void commit_filter_bm(void)
+{
+  bmprintf("filter commits (author:\"First Last\", since:, until:, merges, no-merges, path:): %s",
+	   commit_filter.input);
+}
+
+static int set_commit_filter(char cmd)
+{
+  snprintf(commit_filter.input, sizeof(commit_filter.input), "%s",
+	   commit_filter.spec);
+  commit_filter.input_used = strlen(commit_filter.input);
+  commit_filter_bm();
+
+  state = main_loop_state::INPUT_COMMIT_FILTER;
+  return 1;
+}
+
+static int input_commit_filter(char key)
+{
+  switch (key) {
+  case 0x7f:			/* backspace */
+    if (commit_filter.input_used)
+      commit_filter.input[--commit_filter.input_used] = '\0';
+    commit_filter_bm();
+    return 1;
+
+  case 0x1b:			/* escape */
+    memset(bottom_message, 0, bottom_message_size);
+    state = main_loop_state::DEFAULT;
+    return 1;
+
+  case 0xd: {			/* enter */
+    char input[COMMIT_FILTER_SIZE + 1];
+
+    strcpy(input, commit_filter.input);
+    state = main_loop_state::DEFAULT;
+
+    if (!commit_filter_parse(input)) {
+      bmprintf("invalid filter: %s", commit_filter.input);
+      return 1;
+    }
+
+    /* only separators means no filter */
+    if (strspn(commit_filter.input, " ") == strlen(commit_filter.input))
+      commit_filter.spec[0] = '\0';
+    else
+      strcpy(commit_filter.spec, commit_filter.input);
+
+    if (commit_filter.path[0] && !commit_graph_has_bloom())
+      bmprintf("no changed-path Bloom filters in the commit graph, "
+	       "commits are loaded to filter the path");
+    else if (commit_filter_active())
+      bmprintf("h and l show commits matching the filter");
+    else
+      bmprintf("filter cleared");
+    return 1;
+  }
+
+  default:
+    if (commit_filter.input_used == COMMIT_FILTER_SIZE || !isprint(key))
+      return 0;
+
+    commit_filter.input[commit_filter.input_used++] = key;
+    commit_filter_bm();
+    return 1;
+  }
+}
+
+/*
+ * filter walk: h and l with the commit filter pass commits filtered out as a
+ * job, reading git log and loading diffs for the path can take long
+ */
+static struct {
+  struct commit *p;
+  bool older;
+  int nr_passed;
+  /* why no commit matches, when p is NULL */
+  const char *end;
+} filter_walk;
+
+static int search_load_compl(struct commit_load *l, bool aborted);
+
+/* filter_walk_next(): move p one commit in the direction, false at the end */
+static bool filter_walk_next(void)
+{
+  struct commit *p = filter_walk.p;
+
+  if (filter_walk.older) {
+    if (p == range_begin) {
+      filter_walk.end = "no older commit in the range matches the filter";
+      return false;
+    }
+
+    if (!p->prev)
+      read_commit();
+
+    if (!p->prev) {
+      filter_walk.end = "no older commit matches the filter";
+      return false;
+    }
+
+    filter_walk.p = p->prev;
+  } else {
+    if (p == range_end) {
+      filter_walk.end = "no newer commit in the range matches the filter";
+      return false;
+    }
+
+    if (!p->next) {
+      filter_walk.end = "no newer commit matches the filter";
+      return false;
+    }
+
+    filter_walk.p = p->next;
+  }
+
+  filter_walk.nr_passed++;
+  return true;
+}
+
+static int filter_walk_step(void);
+static void filter_walk_compl(bool stopped);
+
+static struct job filter_walk_job = {
+  "looking for a commit matching the filter", job_prio::SCREEN, true,
+  filter_walk_step, filter_walk_compl,
+};
+
+static void filter_walk_bm(void)
+{
+  bmprintf("looking for a commit matching the filter... (%d commits)",
+	   filter_walk.nr_passed);
+}
+
+static int filter_walk_step(void)
+{
+  for (int i = 0; i < FILL_HISTORY_BATCH; i++) {
+    struct commit *p = filter_walk.p;
+
+    /* commits filtered out by metadata or Bloom filters aren't loaded */
+    if (p != current && commit_filter_match(p)) {
+      /* merges aren't checked with their texts, see commit_filter_path() */
+      if (!commit_filter.path[0] || 1 < p->nr_parents)
+	return 1;
+
+      /* the foreground load is free, searches don't run meanwhile */
+      if (!cache_filled(p)) {
+	load_start(&search_load, p, true, search_load_compl);
+	filter_walk_job.blocked = true;
+	filter_walk_bm();
+	return 0;
+      }
+
+      if (commit_filter_path(p))
+	return 1;
+    }
+
+    if (!filter_walk_next()) {
+      filter_walk.p = NULL;
+      return 1;
+    }
+  }
+
+  filter_walk_bm();
+  return 0;
+}
+
+static void filter_walk_compl(bool stopped)
+{
+  load_cancel(&search_load);
+
+  if (stopped)
+    bmprintf("stop looking for a commit matching the filter");
+  else if (!filter_walk.p)
+    bmprintf("%s", filter_walk.end);
+  else {
+    memset(bottom_message, 0, bottom_message_size);
+
+    current = filter_walk.p;
+    current->head_line = 0;
+  }
+
+  filter_walk.p = NULL;
+}
+
+static void filter_walk_start(bool older)
+{
+  filter_walk.p = current;
+  filter_walk.older = older;
+  filter_walk.nr_passed = 0;
+
+  job_start(&filter_walk_job);
+}
+
+static int show_prev_commit(char cmd)
+{
+  if (current == range_begin) {
+    bmprintf("begin of range...");
+    return 0;
+  }
+
+  if (!current->prev) {
+    read_commit();
+
+    if (!current->prev)
+      return 0;
+  }
+
+  if (commit_filter_active()) {
+    filter_walk_start(true);
+    return 1;
+  }
+
+  current = current->prev;
+  current->head_line = 0;
+
+  return 1;
+}
+
+static int show_next_commit(char cmd)
+{
+  if (current == range_end) {
+    bmprintf("end of range...");
+    return 1;
+  }
+
+  if (!current->next) {
+    if (current != root || !root_detached())
+      return 0;
+
+    /* commits between HEAD and root are read lazily */
+    orig_before_fill_history = current;
+    job_start(&fill_history_job);
+
+    bmprintf("reading history until root...");
+    return 1;
+  }
+
+  if (commit_filter_active()) {
+    filter_walk_start(false);
+    return 1;
+  }
+
+  current = current->next;
+  current->head_line = 0;
+
+  return 1;
+}
+
+static int forward_line(char cmd)
+{
+  struct commit_cached *cached = screen_cached();
+  if (!cached)
+    return 0;
+
+  if (current->head_line + row < cached->nr_lines) {
+    current->head_line++;
+    return 1;
+  }
+
+  return 0;
+}
+
+static int backward_line(char cmd)
+{
+  if (0 < current->head_line) {
+    current->head_line--;
+    return 1;
+  }
+
+  return 0;
+}
+
+static int goto_top(char cmd)
+{
+  if (!current->head_line)
+    return 0;
+
+  current->head_line = 0;
+  return 1;
+}
+
+static int goto_bottom(char cmd)
+{
+  struct commit_cached *cached = screen_cached();
+  if (!cached)
+    return 0;
+
+  if (cached->nr_lines < row)
+    return 0;
+
+  current->head_line = cached->nr_lines - row;
+  return 1;
+}
+
+static int forward_page(char cmd)
+{
+  struct commit_cached *cached = screen_cached();
+  if (!cached)
+    return 0;
+
+  if (cached->nr_lines < current->head_line + row)
+    return 0;
+
+  current->head_line += row;
+  if (cached->nr_lines < current->head_line + row)
+    current->head_line = cached->nr_lines - row;
+
+  return 1;
+}
+
+static int backward_page(char cmd)
+{
+  if (!current->head_line)
+    return 0;
+
+  current->head_line -= row;
+  if (current->head_line < 0)
+    current->head_line = 0;
+
+  return 1;
+}
+
+static int jump_to_log_idx(long idx);
+
+static int show_root(char cmd)
+{
+  if (range_begin) {
+    current = range_begin;
+    return 1;
+  }
+
+  /*
+   * roots may be out of the limited history, the last one is the oldest.
+   * the oldest commit of a file history is its root.
+   */
+  if (git_history_limited() || file_history_path)
+    return jump_to_log_idx(LONG_MAX);
+
+  if (!root)
+    find_root();
+
+  if (!root) {
+    bmprintf("root commit not found");
+    return 1;
+  }
+
+  current = root;
+  current->head_line = 0;
+
+  return 1;
+}
+
+static int show_head(char cmd)
+{
+  if (current == head)
+    return 0;
+
+  if (range_end)
+    current = range_end;
+  else
+    current = head;
+
+  current->head_line = 0;
+
+  return 1;
+}
+
+#define COUNT_PREFIX_MAX 100000000
+static int count_prefix;
+
+static int input_count_prefix(char cmd)
+{
+  if (count_prefix < COUNT_PREFIX_MAX)
+    count_prefix = count_prefix * 10 + (cmd - '0');
+
+  bmprintf("%d", count_prefix);
+  return 1;
+}
+
+/* commit at idx in the output of git log, idx must be already read */
+static struct commit *commit_at(long idx)
+{
+  struct commit *c;
+
+  assert(0 <= idx && idx < nr_read_commits);
+
+  if (idx < nr_read_commits / 2) {
+    for (c = head; c->log_idx != idx; c = c->prev)
+      ;
+  } else {
+    for (c = tail; c->log_idx != idx; c = c->next)
+      ;
+  }
+
+  return c;
+}
+
+static long jump_target;
+
+static int jump_step(void)
+{
+  for (int i = 0; i < FILL_HISTORY_BATCH; i++) {
+    if (jump_target < nr_read_commits || read_end)
+      return 1;
+
+    read_commit();
+  }
+
+  bmprintf("reading history... (%d/%ld commits)",
+	   nr_read_commits, jump_target + 1);
+  return 0;
+}
+
+static void jump_compl(bool stopped)
+{
+  if (stopped) {
+    bmprintf("stop reading history");
+    return;
+  }
+
+  memset(bottom_message, 0, bottom_message_size);
+
+  current = commit_at(min(jump_target, (long)nr_read_commits - 1));
+  current->head_line = 0;
+}
+
+static struct job jump_job = {
+  "reading history", job_prio::SCREEN, true, jump_step, jump_compl,
+};
+
+static int jump_percent(char cmd)
+{
+  int percent = min(count_prefix, 100);
+
+  if (nr_history <= 0) {
+    bmprintf("size of history is unknown yet");
+    return 1;
+  }
+
+  /* 0% is HEAD, 100% is the oldest commit */
+  return jump_to_log_idx((nr_history - 1) * percent / 100);
+}
+
+/* jump_to_log_idx(): jump to idx in git log, reading history if needed */
+static int jump_to_log_idx(long idx)
+{
+  jump_target = idx;
+
+  if (jump_target < nr_read_commits || read_end) {
+    current = commit_at(min(jump_target, (long)nr_read_commits - 1));
+    current->head_line = 0;
+    memset(bottom_message, 0, bottom_message_size);
+
+    return 1;
+  }
+
+  job_start(&jump_job);
+
+  bmprintf("reading history...");
+  return 1;
+}
+
+#define QUERY_SIZE 128
+static char query[QUERY_SIZE + 1];
+static int query_used;
+
+/* lines of these classes are searched */
+static unsigned int match_filter = LINE_CLASS_ALL;
+
+enum class match_type {
+  DEFAULT,
+  MODIFIED,
+  AT,
+  COMMIT_MESSAGE,
+  FILE,
+};
+
+static match_type current_match_type = match_type::DEFAULT;
+static char *current_match_type_str(void)
+{
+  string ret;
+
+  switch (current_match_type) {
+  case match_type::DEFAULT:
+    ret = "default";
+    break;
+  case match_type::MODIFIED:
+    ret = "modified";
+    break;
+  case match_type::AT:
+    ret = "at";
+    break;
+  case match_type::COMMIT_MESSAGE:
+    ret = "commit";
+    break;
+  case match_type::FILE:
+    ret = "file";
+    break;
+  default:
+    die("invalid match type: %d\n", current_match_type);
+    break;
+  };
+
+  return const_cast<char *>(ret.c_str());
+}
+
+static int match_line(char *line)
+{
+  if (!regexec(re_compiled, line, 0, NULL, REG_NOTEOL))
+    return 1;
+
+  return 0;
+}
+
+static int match_commit_regex(struct commit *c, struct commit_cached *cached,
+			      int direction, int prog)
+{
+  int nli, result;
+  char *line;
+
+  if (!cached->nr_lines)
+    return 0;
+
+  /* INT_MAX is used for the bottom of commits not loaded yet */
+  if (cached->nr_lines <= c->head_line)
+    c->head_line = cached->nr_lines - 1;
+
+  int i = c->head_line;
+
+  if (prog) {
+    /* exclude current line */
+
+    if (direction) {
+      if (cached->nr_lines <= i - 1)
+	return 0;
+    } else {
+      if (!i)
+	return 0;
+    }
+
+    i += direction ? 1 : -1;
+  }
+
+  do {
+    /* lines filtered out are skipped without touching the text */
+    if (!(match_filter & line_class_bit(cached->line_classes[i]))) {
+      i += direction ? 1 : -1;
+      continue;
+    }
+
+    line = cached->lines[i];
+    if (line == nullptr)
+      return 0;
+
+    nli = ret_nl_index(line);
+    line[nli] = '\0';
+    result = match_line(line);
+    line[nli] = '\n';
+
+    if (result) {
+      c->head_line = i;
+      return 1;
+    }
+
+    i += direction ? 1 : -1;
+  } while (direction ? i < cached->nr_lines : 0 <= i);
+
+  return 0;
+}
+
+static int match_commit(struct commit *c, int direction, int prog)
+{
+  struct commit_cached *cached = cache_pin(c);
+  int ret = match_commit_regex(c, cached, direction, prog);
+
+  /* a scan touches every page of a spilled text */
+  release_cold_pages(c);
+  cache_unpin(c);
+
+  return ret;
+}
+
+static int current_direction, current_global;
+
+static const char *match_list_status(void);
+
+#define update_query_bm()	do {				\
+    bmprintf("%s %s search (filter: %s, type: %s): %s%s",	\
+	     current_direction ? "forward" : "backward",	\
+	     current_global ? "global" : "local",		\
+	     current_match_type_str(),				\
+	     current_search_type == search_type::REGEX ?		\
+	     "regex" : "FTS",					\
+	     query, match_list_status());			\
+    bm_shows_query = true;					\
+  } while (0)
+
+/*
+ * message grep: commits whose messages match the query of a global search
+ * with the commit message filter, streamed from git log --grep. the other
+ * commits are skipped without loading their texts.
+ */
+#define MSG_GREP_READ_SIZE (41 * 256)
+
+static struct {
+  pid_t pid;
+  int fd;
+  bool active, done;
+
+  /* matched commits in the order of git log */
+  vector<struct commit *> matched;
+  /* hits not found in the history yet, in the order of git log */
+  deque<string> pending;
+  /* commits up to last in git log are decided, NULL before the first hit */
+  struct commit *last;
+
+  char partial[41];
+  int nr_partial;
+} msg_grep = { 0, -1, };
+
+static int msg_grep_step(void);
+static void msg_grep_compl(bool stopped);
+
+/* the hits past the read history are resolved in background */
+static struct job msg_grep_job = {
+  "resolving message grep hits", job_prio::SEARCH, false,
+  msg_grep_step, msg_grep_compl,
+};
+
+static void msg_grep_stop(void)
+{
+  job_cancel(&msg_grep_job);
+
+  if (msg_grep.fd != -1) {
+    kill(msg_grep.pid, SIGKILL);
+    waitpid(msg_grep.pid, NULL, 0);
+    close(msg_grep.fd);
+  }
+
+  msg_grep.fd = -1;
+  msg_grep.active = msg_grep.done = false;
+  msg_grep.matched.clear();
+  msg_grep.pending.clear();
+  msg_grep.last = NULL;
+  msg_grep.nr_partial = 0;
+}
+
+/*
+ * msg_grep_usable(): git log --grep matches raw message lines, but glg
+ * matches them with the 4 spaces of git show. the grep is used only for
+ * queries which can't match the indent: no anchor or alternation, and the
+ * first char is a literal one which isn't optional.
+ */
+static bool msg_grep_usable(const char *q)
+{
+  if (strchr(q, '^') || strstr(q, "\\|"))
+    return false;
+
+  if (!q[0] || strchr(" \t.[\\", q[0]))
+    return false;
+
+  return q[1] != '*' && strncmp(q + 1, "\\?", 2) && strncmp(q + 1, "\\{", 2);
+}
+
+static void msg_grep_start(void)
+{
+  msg_grep_stop();
+
+  if (!msg_grep_usable(query))
+    return;
+
+  msg_grep.pid = launch_git_log_grep(query, &msg_grep.fd);
+  msg_grep.active = true;
+}
+
+/*
+ * msg_grep_resolve(): find pending hits in the history, walking at most nr
+ * commits. git log is read only if read is set. false if the walk can't
+ * go on without reading.
+ */
+static bool msg_grep_resolve(int nr, bool read)
+{
+  struct commit *p;
+
+  for (int i = 0; i < nr && !msg_grep.pending.empty(); i++) {
+    if (!msg_grep.last)
+      p = head;
+    else {
+      if (!msg_grep.last->prev && read)
+	read_commit();
+      p = msg_grep.last->prev;
+    }
+
+    if (!p) {
+      /* the history is changed, the grep is restarted by history_update() */
+      if (read)
+	msg_grep.pending.clear();
+      return false;
+    }
+
+    msg_grep.last = p;
+    if (!strcmp(p->commit_id, msg_grep.pending.front().c_str())) {
+      msg_grep.matched.push_back(p);
+      msg_grep.pending.pop_front();
+    }
+  }
+
+  return true;
+}
+
+static int msg_grep_step(void)
+{
+  msg_grep_resolve(FILL_HISTORY_BATCH, true);
+  return msg_grep.pending.empty();
+}
+
+static void msg_grep_compl(bool stopped)
+{
+}
+
+static int msg_grep_pollfd(struct pollfd *pfd)
+{
+  pfd->fd = msg_grep.fd;
+  pfd->events = POLLIN;
+  pfd->revents = 0;
+
+  return 1;
+}
+
+static void msg_grep_handle_pollfd(struct pollfd *pfd)
+{
+  static char buf[MSG_GREP_READ_SIZE];
+
+  if (!(pfd->revents & (POLLIN | POLLHUP)))
+    return;
+
+  ssize_t ret = read(msg_grep.fd, buf, sizeof(buf));
+  if (ret < 0) {
+    if (errno == EINTR || errno == EAGAIN)
+      return;
+
+    die("read() failed\n");
+  }
+
+  if (!ret) {
+    waitpid(msg_grep.pid, NULL, 0);
+    close(msg_grep.fd);
+    msg_grep.fd = -1;
+    msg_grep.done = true;
+    return;
+  }
+
+  for (ssize_t i = 0; i < ret; i++) {
+    if (buf[i] != '\n') {
+      if (msg_grep.nr_partial < 40)
+	msg_grep.partial[msg_grep.nr_partial++] = buf[i];
+      continue;
+    }
+
+    msg_grep.partial[msg_grep.nr_partial] = '\0';
+    if (msg_grep.nr_partial == 40)
+      msg_grep.pending.push_back(msg_grep.partial);
+    msg_grep.nr_partial = 0;
+  }
+
+  /* hits in the read history are found here, without reading git log */
+  if (!msg_grep_resolve(INT_MAX, false) && !job_running(&msg_grep_job))
+    job_start(&msg_grep_job);
+}
+
+/* msg_grep_test(): 1 if the grep matched c, 0 if not, -1 if not known yet */
+static int msg_grep_test(struct commit *c)
+{
+  if ((!msg_grep.done || !msg_grep.pending.empty())
+      && (!msg_grep.last || msg_grep.last->log_idx < c->log_idx
+	  || c->log_idx < 0))
+    return -1;
+
+  auto it = lower_bound(msg_grep.matched.begin(), msg_grep.matched.end(), c,
+			[](struct commit *a, struct commit *b) {
+			  return a->log_idx < b->log_idx;
+			});
+
+  return it != msg_grep.matched.end() && *it == c;
+}
+
+/*
+ * search_test(): 1 if c is scanned by searches, 0 if it is skipped without
+ * loading (the commit filter or the message grep), -1 if not known yet
+ */
+static int search_test(struct commit *c)
+{
+  if (!commit_filter_match(c))
+    return 0;
+
+  return msg_grep.active ? msg_grep_test(c) : 1;
+}
+
+/*
+ * match list: all matched lines of a global regex search, collected in
+ * background from HEAD (or the end of the range) toward older commits.
+ * hits are sorted in the forward direction, so n and p can jump through it.
+ */
+struct match_hit {
+  struct commit *commit;
+  int line;
+};
+
+#define MATCH_LIST_INIT_SIZE 1024
+/* commits scanned by workers at once, their hits are merged in order */
+#define MATCH_SCANS_MAX 8
+#define MATCH_BM_INTERVAL_MS 100
+
+/*
+ * match_scan: a scan of a pinned text by a worker. each slot has its own
+ * copy of the regex, glibc serializes regexec() on the same regex_t.
+ */
+struct match_scan {
+  struct task task;
+  regex_t re;
+  struct commit *commit;
+  struct commit_cached *cached;
+  vector<int> lines;
+  bool done;
+};
+
+static struct {
+  struct match_hit *hits;
+  int nr_hits, hits_size;
+  /* index of the hit which current is placed on, -1 if unknown */
+  int cursor;
+
+  /* active: a global search is on going */
+  bool active, running;
+
+  /* commits before scan_commit are already scanned */
+  struct commit *scan_commit, *scan_end;
+  int first_idx;
+
+  /* copied for workers, the query and the filter can change meanwhile */
+  unsigned int filter;
+
+  /* scans in flight from scan_commit, submit_commit is scanned next */
+  struct match_scan scans[MATCH_SCANS_MAX];
+  int scans_head, nr_scans;
+  struct commit *submit_commit;
+
+  struct timespec last_bm;
+} match_list;
+
+static struct commit_load match_load;
+
+static int match_list_load_done(struct commit_load *l, bool aborted)
+{
+  if (!aborted)
+    load_fill(l);
+
+  return 0;
+}
+
+static struct match_scan *match_list_nth_scan(int i)
+{
+  return &match_list.scans[(match_list.scans_head + i) % MATCH_SCANS_MAX];
+}
+
+static int do_search_step(void);
+static void do_search_compl(bool stopped);
+
+static struct job search_job = {
+  "search", job_prio::SEARCH, true, do_search_step, do_search_compl,
+};
+
+static int match_list_job_step(void);
+static void match_list_job_compl(bool stopped);
+
+static struct job match_list_job = {
+  "match list", job_prio::SEARCH, false,
+  match_list_job_step, match_list_job_compl,
+};
+
+static void match_list_stop(void)
+{
+  job_cancel(&match_list_job);
+  load_cancel(&match_load);
+
+  for (int i = 0; i < match_list.nr_scans; i++) {
+    struct match_scan *scan = match_list_nth_scan(i);
+
+    task_cancel(&scan->task);
+    cache_unpin(scan->commit);
+  }
+  match_list.nr_scans = 0;
+
+  for (int i = 0; match_list.active && i < MATCH_SCANS_MAX; i++)
+    regfree(&match_list.scans[i].re);
+  msg_grep_stop();
+
+  match_list.active = match_list.running = false;
+  match_list.nr_hits = 0;
+  match_list.cursor = -1;
+  match_list.scan_commit = NULL;
+}
+
+static void match_list_start(void)
+{
+  match_list_stop();
+
+  if (!match_list.hits) {
+    match_list.hits_size = MATCH_LIST_INIT_SIZE;
+    match_list.hits = static_cast<struct match_hit *>(xalloc(match_list.hits_size * sizeof(struct match_hit)));
+  }
+
+  /* the query is already compiled successfully by the search */
+  for (int i = 0; i < MATCH_SCANS_MAX; i++) {
+    if (regcomp(&match_list.scans[i].re, query, REG_ICASE)) {
+      while (i--)
+	regfree(&match_list.scans[i].re);
+      return;
+    }
+  }
+  match_list.filter = match_filter;
+
+  /* git log greps messages far faster than the texts are loaded */
+  if (match_filter == line_class_bit(line_class::MESSAGE) && !file_history_path)
+    msg_grep_start();
+
+  match_list.scan_commit = range_end ? range_end : head;
+  match_list.submit_commit = match_list.scan_commit;
+  match_list.scan_end = range_begin;
+  match_list.first_idx = match_list.scan_commit->log_idx;
+  match_list.scans_head = match_list.nr_scans = 0;
+  match_list.active = match_list.running = true;
+
+  job_start(&match_list_job);
+}
+
+/* compare position (c, line) with a hit in the forward direction */
+static int match_pos_cmp(struct commit *c, int line, struct match_hit *hit)
+{
+  if (c->log_idx != hit->commit->log_idx)
+    return c->log_idx < hit->commit->log_idx ? -1 : 1;
+
+  return line < hit->line ? -1 : line > hit->line;
+}
+
+/* first index of a hit which isn't before (c, line) */
+static int match_list_lower_bound(struct commit *c, int line)
+{
+  int lo = 0, hi = match_list.nr_hits;
+
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+
+    if (0 < match_pos_cmp(c, line, &match_list.hits[mid]))
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  return lo;
+}
+
+/* true if (c, line) is before the scanning position */
+static bool match_list_scanned(struct commit *c, int line)
+{
+  if (c->log_idx < 0 || c->log_idx < match_list.first_idx)
+    return false;
+
+  if (!match_list.scan_commit)
+    return true;
+
+  return c->log_idx < match_list.scan_commit->log_idx;
+}
+
+static const char *match_list_status(void)
+{
+  static char buf[64];
+
+  if (!match_list.active) {
+    buf[0] = '\0';
+    return buf;
+  }
+
+  if (0 <= match_list.cursor)
+    snprintf(buf, sizeof(buf), " (match %d/%d%s)", match_list.cursor + 1,
+	     match_list.nr_hits, match_list.running ? "+" : "");
+  else
+    snprintf(buf, sizeof(buf), " (match -/%d%s)",
+	     match_list.nr_hits, match_list.running ? "+" : "");
+
+  return buf;
+}
+
+static void match_list_sync_cursor(void)
+{
+  int i = match_list_lower_bound(current, current->head_line);
+
+  if (i < match_list.nr_hits
+      && !match_pos_cmp(current, current->head_line, &match_list.hits[i]))
+    match_list.cursor = i;
+  else
+    match_list.cursor = -1;
+}
+
+static void match_list_push(struct commit *c, int line)
+{
+  if (match_list.nr_hits == match_list.hits_size) {
+    match_list.hits_size <<= 1;
+    match_list.hits = static_cast<struct match_hit *>(xrealloc(match_list.hits,
+							       match_list.hits_size * sizeof(struct match_hit)));
+  }
+
+  match_list.hits[match_list.nr_hits].commit = c;
+  match_list.hits[match_list.nr_hits].line = line;
+  match_list.nr_hits++;
+}
+
+static void match_list_done(void)
+{
+  match_list.running = false;
+  match_list.scan_commit = NULL;
+}
+
+/* match_scan_run(): called in a worker, the text isn't modified */
+static void match_scan_run(struct task *t)
+{
+  struct match_scan *scan = static_cast<struct match_scan *>(t->arg);
+  struct commit_cached *cached = scan->cached;
+
+  for (int i = 0; i < cached->nr_lines; i++) {
+    if (!(match_list.filter & line_class_bit(cached->line_classes[i])))
+      continue;
+
+    regmatch_t range;
+    range.rm_so = 0;
+    range.rm_eo = line_len(cached, i);
+
+    if (!regexec(&scan->re, cached->lines[i], 1, &range,
+		 REG_STARTEND | REG_NOTEOL))
+      scan->lines.push_back(i);
+  }
+}
+
+static void match_scan_done(struct task *t)
+{
+  static_cast<struct match_scan *>(t->arg)->done = true;
+}
+
+/* match_list_next(): the commit scanned after c, NULL at the end */
+static struct commit *match_list_next(struct commit *c)
+{
+  if (c == match_list.scan_end)
+    return NULL;
+
+  if (!c->prev)
+    read_commit();
+
+  return c->prev;
+}
+
+/* match_list_merge(): merge finished scans in order, true if any */
+static bool match_list_merge(void)
+{
+  bool merged = false;
+
+  while (match_list.nr_scans && match_list_nth_scan(0)->done) {
+    struct match_scan *scan = match_list_nth_scan(0);
+    struct commit *c = scan->commit;
+
+    /* false positives of the Bloom filters */
+    if (!scan->lines.empty() && !commit_filter_path(c))
+      scan->lines.clear();
+
+    for (int line : scan->lines)
+      match_list_push(c, line);
+
+    /* a scan touches every page of a spilled text */
+    release_cold_pages(c);
+    cache_unpin(c);
+
+    match_list.scans_head = (match_list.scans_head + 1) % MATCH_SCANS_MAX;
+    match_list.nr_scans--;
+    match_list.scan_commit = match_list.nr_scans ?
+      match_list_nth_scan(0)->commit : match_list.submit_commit;
+    merged = true;
+  }
+
+  if (!match_list.nr_scans && !match_list.submit_commit)
+    match_list_done();
+
+  return merged;
+}
+
+/* match_list_submit(): pass loaded commits to workers, load the next one */
+static void match_list_submit(void)
+{
+  while (match_list.nr_scans < MATCH_SCANS_MAX && match_list.submit_commit) {
+    struct commit *c = match_list.submit_commit;
+
+    int matched = search_test(c);
+    if (matched < 0)
+      break;
+
+    if (!matched) {
+      match_list.submit_commit = match_list_next(c);
+      if (!match_list.nr_scans)
+	match_list.scan_commit = match_list.submit_commit;
+      continue;
+    }
+
+    struct commit_cached *cached = search_filled(c) ?
+      cache_pin_nowait(c) : NULL;
+    if (!cached) {
+      /* the screen is loaded before the match list */
+      if (!match_load.commit && !screen_load.commit)
+	load_start(&match_load, c, true, match_list_load_done);
+      break;
+    }
+
+    struct match_scan *scan = match_list_nth_scan(match_list.nr_scans++);
+    scan->task.run = match_scan_run;
+    scan->task.done = match_scan_done;
+    scan->task.arg = scan;
+    scan->commit = c;
+    scan->cached = cached;
+    scan->lines.clear();
+    scan->done = false;
+    task_submit(&scan->task);
+
+    match_list.submit_commit = match_list_next(c);
+  }
+
+  if (!match_list.nr_scans && !match_list.submit_commit)
+    match_list_done();
+}
+
+/* match_list_step(): scan a part of history. return 1 for updating screen */
+static int match_list_step(void)
+{
+  bool merged = match_list_merge();
+
+  if (match_list.running) {
+    match_list_submit();
+
+    /* woken up by the workers, match_load or the message grep */
+    match_list_job.blocked = true;
+
+    /* the rest is skipped by the message grep */
+    if (!match_list.running)
+      merged = true;
+  }
+
+  /* results of the search aren't overwritten */
+  if (!merged || state != main_loop_state::SEARCHING_QUERY
+      || !(bm_shows_query || job_running(&search_job)))
+    return 0;
+
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  long elapsed = (now.tv_sec - match_list.last_bm.tv_sec) * 1000
+    + (now.tv_nsec - match_list.last_bm.tv_nsec) / 1000000;
+  if (match_list.running && elapsed < MATCH_BM_INTERVAL_MS)
+    return 0;
+
+  match_list.last_bm = now;
+  match_list_sync_cursor();
+  update_query_bm();
+
+  return 1;
+}
+
+static int match_list_job_step(void)
+{
+  if (match_list_step())
+    update_terminal();
+
+  return !match_list.running;
+}
+
+static void match_list_job_compl(bool stopped)
+{
+  /* hits are kept until match_list_stop() */
+}
+
+/*
+ * match_list_jump(): move to the next or previous hit with the match list.
+ * return 1 when moved, 0 when no hit exists, -1 when the list can't tell
+ * it yet.
+ */
+static int match_list_jump(int direction)
+{
+  if (!match_list.active)
+    return -1;
+
+  struct commit *c = current;
+  int line = c->head_line, i;
+
+  if (0 <= match_list.cursor && match_list.cursor < match_list.nr_hits
+      && !match_pos_cmp(c, line, &match_list.hits[match_list.cursor]))
+    i = match_list.cursor + (direction ? 1 : -1);
+  else if (!match_list_scanned(c, line))
+    return -1;
+  else {
+    i = match_list_lower_bound(c, line);
+    if (i < match_list.nr_hits && !match_pos_cmp(c, line, &match_list.hits[i]))
+      i += direction ? 1 : -1;
+    else if (!direction)
+      i--;
+  }
+
+  if (i < 0)
+    return 0;
+
+  if (match_list.nr_hits <= i)
+    return match_list.running ? -1 : 0;
+
+  match_list.cursor = i;
+  current = match_list.hits[i].commit;
+  current->head_line = match_list.hits[i].line;
+
+  return 1;
+}
+
+static bool search_found;
+static struct commit *orig_before_do_search;
+static void do_search_compl(bool stopped)
+{
+  load_cancel(&search_load);
+
+  if (search_found)
+    goto end;
+
+  if (!stopped) {
+    if (!search_found)
+      bmprintf("not found: %s", query);
+
+    goto restore;
+  }
+
+  bmprintf("search stopped");
+
+ restore:
+  current = orig_before_do_search;
+
+ end:
+  search_found = false;
+  orig_before_do_search = NULL;
+}
+
+static int search_load_compl(struct commit_load *l, bool aborted)
+{
+  if (!aborted)
+    load_fill(l);
+
+  /* the search continues without updating the screen */
+  return 0;
+}
+
+/* search_advance(): move current in the direction, false at the end */
+static bool search_advance(void)
+{
+  if (current_direction) {
+    if (current == range_begin)
+      return false;
+
+    if (!current->prev)
+      read_commit();
+
+    if (!current->prev)
+      return false;
+
+    current = current->prev;
+  } else {
+    if (current == range_end)
+      return false;
+
+    if (!current->next)
+      return false;
+
+    current = current->next;
+    current->head_line = INT_MAX;
+  }
+
+  return true;
+}
+
+static int do_search_step(void)
+{
+  int result = 0;
+
+  /* commits filtered out or without matched messages aren't loaded */
+  for (int i = 0; i < FILL_HISTORY_BATCH; i++) {
+    int matched = search_test(current);
+    if (matched < 0) {
+      search_job.blocked = true;
+      return 0;
+    }
+
+    if (matched)
+      break;
+
+    if (!search_advance())
+      goto not_found;
+  }
+
+  if (search_test(current) != 1)
+    return 0;
+
+  if (!search_filled(current)) {
+    load_start(&search_load, current, true, search_load_compl);
+
+    search_job.blocked = true;
+    return 0;
+  }
+
+  result = match_commit(current, current_direction, 0);
+  if (result && commit_filter_path(current)) {
+    if (current_search_type == search_type::FTS)
+      current->head_line = 0;
+
+    search_found = true;
+
+    return 1;
+  }
+
+  if (!search_advance())
+    goto not_found;
+
+  return 0;
+
+ not_found:
+  bmprintf("not found: %s", query);
+  search_found = false;
+
+  return 1;
+}
+
+static int do_search(int direction, int global, int prog)
+{
+  int result;
+
+  result = match_commit(current, direction, prog);
+  if (result)
+    return 1;
+  if (!global)
+    return 0;
+
+  orig_before_do_search = current;
+
+  current_direction = direction;
+  current_global = global;
+
+  if (!search_advance())
+    return 0;
+
+  search_found = false;
+  job_start(&search_job);
+
+  return -1;
+}
+
+static struct {
+  struct commit *commit;
+  int head_line;
+} orig_place;
+
+static void tokenize_query(void)
+{
+  static char *duped_query;
+
+  if (duped_query)
+    free(duped_query);
+
+  duped_query= strdup(query);
+  if (!duped_query)
+    die("strdup() failed\n");
+
+  if (!tokenized_query) {
+    nr_tokenized_query = 0;
+    tokenized_query_size = 1;
+    tokenized_query = static_cast<char **>(xalloc(tokenized_query_size * sizeof(char *)));
+  }
+
+  char *saveptr;
+  tokenized_query[0] = strtok_r(duped_query, " ", &saveptr);
+  nr_tokenized_query = 1;
+
+  char *next_token;
+  while ((next_token = strtok_r(NULL, " ", &saveptr))) {
+    if (nr_tokenized_query == tokenized_query_size) {
+      tokenized_query_size *= 2;
+      tokenized_query =
+	static_cast<char **>(xrealloc(tokenized_query, tokenized_query_size * sizeof(char *)));
+    }
+
+    tokenized_query[nr_tokenized_query++] = next_token;
+  }
+}
+
+static int _search(int key, int direction, int global)
+{
+  current_direction = direction;
+  current_global = global;
+
+  switch (state) {
+  case main_loop_state::DEFAULT:
+  case main_loop_state::SEARCHING_QUERY:
+    current_match_type = match_type::DEFAULT;
+    match_filter = LINE_CLASS_ALL;
+
+  case main_loop_state::INPUT_SEARCH_DIRECTION:
+    query_used = 0;
+    bzero(query, QUERY_SIZE);
+
+    bmprintf("%s %s search (filter: %s, type: %s): ",
+	     current_direction ? "forward" : "backward",
+	     current_global ? "global" : "local",
+	     current_match_type_str(),
+	     current_search_type == search_type::REGEX ? "regex" : "FTS");
+
+    state = main_loop_state::INPUT_SEARCH_QUERY;
+
+    break;
+
+  case main_loop_state::INPUT_SEARCH_QUERY:
+    if (query_used + 1 == QUERY_SIZE) {
+      bmprintf("search query is too long!");
+      state = main_loop_state::DEFAULT;
+
+      goto end;
+    }
+
+    if (key == 0xd /* FIXME: \n ?*/) {
+      state = main_loop_state::SEARCHING_QUERY;
+
+      orig_place.commit = current;
+      orig_place.head_line = current->head_line;
+
+      if (current_search_type == search_type::FTS)
+	tokenize_query();
+
+    } else {
+      query[query_used++] = (char)key;
+      update_query_bm();
+    }
+  end:
+    break;
+
+  default:
+    die("invalid or unknown state: %d", state);
+    break;
+  }
+
+  if (state == main_loop_state::SEARCHING_QUERY) {
+    if (current_search_type == search_type::REGEX) {
+      if (re_compiled)
+	regfree(re_compiled);
+      else
+	re_compiled = static_cast<regex_t *>(xalloc(sizeof(regex_t)));
+      regcomp(re_compiled, query, REG_ICASE);
+    } else {
+      assert(current_search_type == search_type::FTS);
+    }
+
+    if (global && current_search_type == search_type::REGEX)
+      match_list_start();
+    else
+      match_list_stop();
+
+    int result = do_search(direction, global, 0);
+    switch (result) {
+    case 0:
+      bmprintf("not found: %s", query);
+      break;
+    case 1:
+      match_list_sync_cursor();
+      update_query_bm();
+      break;
+    case -1:	/* do nothing, continue */
+      assert(job_running(&search_job));
+      return 0;
+    default:
+      die("invalid return value from do_search(): %d\n", result);
+      break;
+    }
+  }
+
+  return 1;
+}
+
+static int search(int direction, int global)
+{
+  return _search(-1, direction, global);
+}
+
+static int search_global_forward(char cmd)
+{
+  current_search_type = search_type::REGEX;
+  return search(1, 1);
+}
+
+static int search_global_backward(char cmd)
+{
+  current_search_type = search_type::REGEX;
+  return search(0, 1);
+}
+
+static int search_local_forward(char cmd)
+{
+  current_search_type = search_type::REGEX;
+  return search(1, 0);
+}
+
+static int search_local_backward(char cmd)
+{
+  current_search_type = search_type::REGEX;
+  return search(0, 0);
+}
+
+static int search_progress(char cmd)
+{
+  if (state != main_loop_state::SEARCHING_QUERY)
+    return 0;
+
+  assert(cmd == 'n' || cmd == 'p');
+
+  if (current_global) {
+    switch (match_list_jump(cmd == 'n')) {
+    case 1:
+      update_query_bm();
+      return 1;
+    case 0:
+      bmprintf("not found: %s", query);
+      return 1;
+    default:
+      /* not scanned yet */
+      break;
+    }
+  }
+
+  int res = do_search(cmd == 'n' ? 1 : 0, current_global, 1);
+  switch (res) {
+  case 0:
+    bmprintf("not found: %s", query);
+  case 1:
+    return 1;
+  case -1:
+    update_query_bm();
+    return 0;
+  default:
+    die("invalid return value of do_search(): %d", res);
+    return 0;	/* suppress compiler warning */
+  }
+}
+
+static int input_query(char key)
+{
+  if (key == (char)0x7f) {
+    /* backspace */
+    if (!query_used)
+      return 0;
+
+    query[--query_used] = '\0';
+    update_query_bm();
+
+    return 1;
+  } else if (key == (char)0x1b) {
+    /* escape */
+    if (current_search_type == search_type::REGEX
+	&& re_compiled) {
+      regfree(re_compiled);
+      free(re_compiled);
+      re_compiled = NULL;
+    }
+
+    query_used = 0;
+    bzero(query, QUERY_SIZE);
+
+    bzero(bottom_message, bottom_message_size);
+    state = main_loop_state::DEFAULT;
+    return 1;
+  }
+
+  return _search(key, current_direction, current_global);
+}
+
+static int restore_orig_place(char cmd)
+{
+  if (!orig_place.commit)
+    return 0;
+
+  current = orig_place.commit;
+  current->head_line = orig_place.head_line;
+
+  bmprintf("restored  original place");
+
+  return 1;
+}
+
+static int save_orig_place(char cmd)
+{
+  orig_place.commit = current;
+  orig_place.head_line = current->head_line;
+
+  bmprintf("saved current as original place");
+
+  return 1;
+}
+
+static int nop(char cmd)
+{
+  return 0;
+}
+
+static struct commit* get_prev_or_current(struct commit *c)
+{
+  if (c->prev)
+    return c->prev;
+  else {
+    read_commit();
+    if (c->prev)
+      return c->prev;
+  }
+
+  /* hmm... */
+  return c;
+}
+
+static int git_format_patch(bool force)
+{
+  struct commit *begin = range_begin;
+
+  if (!begin)
+    begin = current;
+
+  if (!range_end)
+    range_end = head;
+
+  struct commit *prev_begin = get_prev_or_current(begin);
+
+  char range[83];
+  sprintf(range, "%s..%s", prev_begin->commit_id, range_end->commit_id);
+  range[82] = '\0';
+
+  int ret;
+  char key = ' ';
+  bool retry = false;
+ retry_cover_letter:
+  bool need_cover_letter = false;
+  move(row, 0);
+  for (int i = 0; i < col; i++) printw(" ");
+  move(row, 0);
+  printw("%s%c need cover letter? (y/N): ", retry ? "invalid char: " : "", key);
+  refresh();
+
+  ret = read(tty_fd, &key, 1);
+  if (ret != 1)
+    die("read() failed");
+  switch (key) {
+  case 'y':
+  case 'Y':
+    need_cover_letter = true;
+    break;
+  case 'n':
+  case 'N':
   case 0xd:		/* enter */
     need_cover_letter = false;
     break;
-  case 0x1b:		/* escape */
-    /* cancel of format-patch */
+  case 0x1b:		/* escape */
+    /* cancel of format-patch */
+    return 1;
+  default:
+    retry = true;
+    goto retry_cover_letter;
+  }
+
+  char prefix[32];
+  int prefix_i = 0;
+  memset(prefix, 0, 32);
+ read_prefix:
+  move(row, 0);
+  for (int i = 0; i < col; i++) printw(" ");
+  move(row, 0);
+  printw("prefix of the patchset%s: %s", prefix_i == 31 ? "max" : "", prefix);
+  refresh();
+
+  ret = read(tty_fd, &key, 1);
+  if (ret != 1)
+    die("read() failed");
+
+  if (key == (char)0x7f) {
+    /* backspace */
+    if (prefix_i)
+      prefix[--prefix_i] = '\0';
+    goto read_prefix;
+  } else if (key == (char)0xd) {
+    /* enter */
+    goto end_read_prefix;
+  } else if (key == 0x1b) {
+    /* escape, cancel of format-patch */
+    return 1;
+  }
+
+
+  if (prefix_i == 31) {
+    /* prefix is too long, simply ignore the inputted char */
+    goto read_prefix;
+  }
+
+  prefix[prefix_i++] = key;
+
+  goto read_prefix;
+
+ end_read_prefix:
+  endwin();
+  printf("executing git... good luck!\n");
+  fflush(stdout);
+
+  if (!force) {
+    /* FIXME: how should I treat a case of IP unreachable? */
+    pid_t pid = fork();
+    switch (pid) {
+    case -1:
+      die("fork() failed\n");
+      break;
+    case 0:;
+      int pid2;
+      pid2 = fork();
+      switch (pid2) {
+      case 0:
+	execlp("git", "git", "remote", "update", NULL);
+	break;
+      case -1:
+	die("fork() failed\n");
+	break;
+      default:
+	waitpid(pid2, NULL, 0);
+	break;
+      }
+      /* FIXME: "origin/master" is always suitable? */
+      execlp("git", "git", "rebase", "origin/master", NULL);
+      break;
+    default:;
+      int status;
+      waitpid(pid, &status, 0);
+      if (WEXITSTATUS(status)) {
+	/* if rebase found something, it returns 1 */
+	printf("rebase found something, you should check before posting patch!\n");
+	exit(0);
+      }
+
+      break;
+    }
+  }
+
+  static char *execvp_args[6];
+  int execvp_args_i = 0;
+  execvp_args[execvp_args_i++] = const_cast<char *>("git");
+  execvp_args[execvp_args_i++] = const_cast<char *>("format-patch");
+  if (need_cover_letter)
+    execvp_args[execvp_args_i++] = const_cast<char *>("--cover-letter");
+  if (strlen(prefix)) {
+    static char subject_prefix[64];
+    snprintf(subject_prefix, 64, "--subject-prefix=%s", prefix);
+    execvp_args[execvp_args_i++] = subject_prefix;
+  }
+  execvp_args[execvp_args_i++] = const_cast<char *>("-C");
+  execvp_args[execvp_args_i++] = range;
+  execvp_args[execvp_args_i++] = NULL;
+
+  execvp("git", execvp_args);
+  die("execvp() failed\n");
+
+  /* never reach */
+  return 1;
+}
+
+static int git_rebase_i(void)
+{
+  struct commit *prev = get_prev_or_current(current);
+
+  endwin();
+  printf("executing git... good luck!\n");
+  fflush(stdout);
+
+  close(stdin_fd);
+  stdin_fd = open("/dev/tty", O_RDONLY);
+  if (stdin_fd != 0)
+    die("failed to open /dev/tty\n");
+
+  close(1);
+  int stdout_fd = open("/dev/tty", O_WRONLY);
+  if (stdout_fd != 1)
+    die("failed to open /dev/tty]n\n");
+  execlp("git", "git", "rebase", "-i", prev->commit_id, NULL);
+  die("execlp() failed\n");
+
+  /* never reach */
+  return 1;
+}
+
+static int git_bisect(void)
+{
+  if (!range_begin || !range_end) {
+    bmprintf("bisect begin and end are required before format-patch");
+    state = main_loop_state::DEFAULT;
+
+    return 1;
+  }
+
+  struct commit *prev_range_begin = get_prev_or_current(range_begin);
+
+  endwin();
+
+  execlp("git", "git", "bisect", "start",
+	 range_end->commit_id, prev_range_begin->commit_id, NULL);
+  die("execlp() failed\n");
+
+  /* never reach */
+  return 1;
+}
+
+static int git_revert(void)
+{
+  endwin();
+  execlp("git", "git", "revert", current->commit_id, NULL);
+  die("execlp() failed\n");
+
+  /* never reach */
+  return 1;
+}
+
+static char checkout_branch_name[1024];
+static int branch_name_idx;
+
+static void git_checkout_b(void)
+{
+  endwin();
+  printf("executing git... good luck\n");
+  fflush(stdout);
+
+  /* TODO: check existence of branch here, before execlp() */
+  execlp("git", "git", "checkout", "-b",
+	 checkout_branch_name, current->commit_id, NULL);
+  die("execlp() failed\n");
+}
+
+static int launch_git_command(char cmd)
+{
+  bmprintf("launch git command f (format-patch), r (rebase -i), c(checkout -b), b(bisect):");
+  state = main_loop_state::LAUNCH_GIT_COMMAND;
+  return 1;
+}
+
+static int show_full_diff(char cmd)
+{
+  struct commit_cached *cached = screen_cached();
+  if (!cached)
+    return 0;
+
+  if (cached->level == diff_level::FULL) {
+    bmprintf("the full diff is already shown");
+    return 1;
+  }
+
+  /* the budgets aren't applied to the commit from now */
+  current->full_diff = true;
+  screen_unpin();
+  if (!evict_commit(current)) {
+    bmprintf("the commit is in use, try again later");
+    return 1;
+  }
+
+  memset(bottom_message, 0, bottom_message_size);
+  return 1;
+}
+
+static int show_changed_files(char cmd)
+{
+  changed_files_cursor = 0;
+  state = main_loop_state::SHOW_CHANGED_FILES;
+  return 1;
+}
+
+/* chains of the files followed so far, reused when one is followed again */
+static map<string, struct commit_chain> file_histories;
+
+static void save_chain(struct commit_chain *chain)
+{
+  chain->head = head;
+  chain->tail = tail;
+  chain->root = root;
+  chain->current = current;
+  chain->range_begin = range_begin;
+  chain->range_end = range_end;
+
+  chain->fd = stdin_fd;
+  chain->buf = log_buf;
+  chain->read_end = read_end;
+  chain->nr_read_commits = nr_read_commits;
+
+  chain->nr_history = nr_history;
+  chain->nr_history_estimated = nr_history_estimated;
+}
+
+static void restore_chain(const struct commit_chain *chain)
+{
+  head = chain->head;
+  tail = chain->tail;
+  root = chain->root;
+  current = chain->current;
+  range_begin = chain->range_begin;
+  range_end = chain->range_end;
+
+  stdin_fd = chain->fd;
+  log_buf = chain->buf;
+  read_end = chain->read_end;
+  nr_read_commits = chain->nr_read_commits;
+
+  nr_history = chain->nr_history;
+  nr_history_estimated = chain->nr_history_estimated;
+}
+
+static void prefetch_stop(void);
+
+/* switch_chain(): save the current chain, false if it can't be switched */
+static bool switch_chain(void)
+{
+  if (jobs_foreground()) {
+    bmprintf("stop the running command before switching history");
+    return false;
+  }
+
+  /* hits and prefetched ranges belong to the chain */
+  match_list_stop();
+  prefetch_stop();
+  last_shown = load_canceled = NULL;
+
+  if (file_history_path)
+    save_chain(&file_histories[file_history_path]);
+  else
+    save_chain(&entire_history);
+
+  return true;
+}
+
+static char follow_target[41];
+
+/* find_follow_target(): place current on the target if it is already read */
+static bool find_follow_target(void)
+{
+  for (struct commit *p = head; p; p = p->prev) {
+    if (!strcmp(p->commit_id, follow_target)) {
+      current = p;
+      current->head_line = 0;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+static int follow_step(void)
+{
+  for (int i = 0; i < FILL_HISTORY_BATCH; i++) {
+    if (read_end)
+      return 1;
+
+    read_commit();
+
+    if (!read_end && !strcmp(tail->commit_id, follow_target))
+      return 1;
+  }
+
+  bmprintf("reading history of %s... (%d commits)",
+	   file_history_path, nr_read_commits);
+  return 0;
+}
+
+static void follow_compl(bool stopped)
+{
+  if (stopped || !find_follow_target())
+    current = head;
+
+  bmprintf("history of %s, F: back to the entire history",
+	   file_history_path);
+}
+
+static struct job follow_job = {
+  "following a file", job_prio::SCREEN, true, follow_step, follow_compl,
+};
+
+/*
+ * follow_file(): walk the commits touching path, from the commit which is
+ * shown in the entire history
+ */
+static int follow_file(const char *path)
+{
+  strcpy(follow_target, current->commit_id);
+
+  if (!switch_chain())
+    return 1;
+
+  auto it = file_histories.find(path);
+  if (it == file_histories.end()) {
+    struct commit_chain chain;
+
+    memset(&chain, 0, sizeof(chain));
+    launch_git_log_follow(path, &chain.fd);
+    chain.buf = alloc_log_buf();
+    chain.nr_history = -1;
+
+    it = file_histories.emplace(path, chain).first;
+  }
+
+  restore_chain(&it->second);
+  file_history_path = it->first.c_str();
+
+  if (!head)
+    read_commit();
+
+  if (!head) {
+    bmprintf("no commit touches %s", path);
+    file_history_path = NULL;
+    restore_chain(&entire_history);
+    return 1;
+  }
+
+  if (!current)
+    current = head;
+
+  if (find_follow_target() || read_end) {
+    bmprintf("history of %s, F: back to the entire history", path);
+    return 1;
+  }
+
+  /* the shown commit is searched for in background */
+  job_start(&follow_job);
+
+  bmprintf("reading history of %s...", path);
+  return 1;
+}
+
+static int leave_file_history(char cmd)
+{
+  if (!file_history_path) {
+    bmprintf("not in file history, select a file in the f view");
+    return 1;
+  }
+
+  if (!switch_chain())
+    return 1;
+
+  file_history_path = NULL;
+  restore_chain(&entire_history);
+
+  memset(bottom_message, 0, bottom_message_size);
+  return 1;
+}
+
+static int changed_files_input(char cmd)
+{
+  switch (cmd) {
+  case 'j':
+    if (changed_files_cursor + 1 < current->nr_file_list) {
+      changed_files_cursor++;
+      return 1;
+    }
+    return 0;
+  case 'k':
+    if (0 < changed_files_cursor) {
+      changed_files_cursor--;
+      return 1;
+    }
+    return 0;
+  case 0xd:			/* enter */
+    if (!current->nr_file_list)
+      return 0;
+
+    state = main_loop_state::DEFAULT;
+    return follow_file(path_name(current->file_list[changed_files_cursor]));
+  case 'q':
+  case 0x1b:
+    state = main_loop_state::DEFAULT;
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+static int show_commit_list(char cmd)
+{
+  if (file_history_path) {
+    bmprintf("commit list isn't available in file history");
+    return 1;
+  }
+
+  /* place the cursor on the current commit, IDs of git log are ordered */
+  int idx = 0;
+  struct commit *p;
+  for (p = current; p && p != head; p = p->next)
+    idx++;
+
+  if (!p)			/* detached root */
+    idx = 0;
+
+  read_commit_list(idx + 1);
+  if (nr_commit_list <= idx)
+    idx = nr_commit_list ? nr_commit_list - 1 : 0;
+
+  commit_list_cursor = idx;
+  if (commit_list_cursor < commit_list_head
+      || commit_list_head + (int)row <= commit_list_cursor)
+    commit_list_head = commit_list_cursor;
+
+  state = main_loop_state::SHOW_COMMIT_LIST;
+  return 1;
+}
+
+static struct commit *nth_commit(int n)
+{
+  struct commit *c = head;
+
+  for (int i = 0; i < n; i++) {
+    if (!c->prev)
+      read_commit();
+
+    if (!c->prev)
+      return nullptr;
+
+    c = c->prev;
+  }
+
+  return c;
+}
+
+static int commit_list_move_cursor(int delta)
+{
+  int dest = commit_list_cursor + delta;
+
+  if (dest < 0)
+    dest = 0;
+
+  read_commit_list(dest + 1);
+  if (nr_commit_list <= dest)
+    dest = nr_commit_list - 1;
+
+  if (dest == commit_list_cursor)
+    return 0;
+
+  commit_list_cursor = dest;
+  if (commit_list_cursor < commit_list_head)
+    commit_list_head = commit_list_cursor;
+  else if (commit_list_head + (int)row <= commit_list_cursor)
+    commit_list_head = commit_list_cursor - row + 1;
+
+  return 1;
+}
+
+static int commit_list_input(char cmd)
+{
+  switch (cmd) {
+  case 'j':
+    return commit_list_move_cursor(1);
+  case 'k':
+    return commit_list_move_cursor(-1);
+  case ' ':
+  case 'J':
+    return commit_list_move_cursor(row);
+  case 'K':
+    return commit_list_move_cursor(-(int)row);
+  case 'g':
+    return commit_list_move_cursor(-commit_list_cursor);
+  case 0xd: {			/* enter */
+    struct commit *c = nth_commit(commit_list_cursor);
+    if (!c || strcmp(c->commit_id, commit_list[commit_list_cursor].commit_id)) {
+      bmprintf("commit list and history are inconsistent");
+      state = main_loop_state::DEFAULT;
+      return 1;
+    }
+
+    current = c;
+    current->head_line = 0;
+    state = main_loop_state::DEFAULT;
+    return 1;
+  }
+  case 'q':
+  case 0x1b:
+    state = main_loop_state::DEFAULT;
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+static int quit(char cmd)
+{
+  running = false;
+  return 0;
+}
+
+/*
+ * prefetching of a specified range or a list of commits: several git show
+ * processes run at once, their outputs are read in the main loop as they
+ * arrive
+ */
+#define PREFETCH_MAX_PARALLEL 8
+
+static struct {
+  struct commit_load slots[PREFETCH_MAX_PARALLEL];
+  int nr_parallel;
+
+  /*
+   * next commit to be launched, walking from range_end to range_begin or
+   * through list
+   */
+  struct commit *next;
+  struct commit **list;
+  int nr_list, list_pos;
+  const char *what;
+  int done, total;
+
+  bool budget_exceeded;
+} prefetch;
+
+static int prefetch_step(void);
+static void prefetch_compl(bool stopped);
+
+static struct job prefetch_job = {
+  "prefetch", job_prio::PREFETCH, false, prefetch_step, prefetch_compl,
+};
+
+static void prefetch_cleanup(void)
+{
+  for (int i = 0; i < prefetch.nr_parallel; i++) {
+    struct commit_load *slot = &prefetch.slots[i];
+
+    load_cancel(slot);
+    load_release_buf(slot);
+  }
+
+  free(prefetch.list);
+  prefetch.list = NULL;
+  prefetch.nr_list = prefetch.list_pos = 0;
+
+  prefetch.next = NULL;
+}
+
+static void prefetch_stop(void)
+{
+  job_cancel(&prefetch_job);
+  prefetch_cleanup();
+}
+
+static void prefetch_advance(void)
+{
+  if (prefetch.list) {
+    prefetch.next = prefetch.list_pos < prefetch.nr_list ?
+      prefetch.list[prefetch.list_pos++] : NULL;
+    return;
+  }
+
+  prefetch.next = prefetch.next == range_begin ? NULL : prefetch.next->prev;
+}
+
+static int prefetch_load_done(struct commit_load *slot, bool aborted);
+
+static void prefetch_launch(struct commit_load *slot)
+{
+  /* commits loaded or being loaded by others are skipped */
+  while (prefetch.next) {
+    struct commit *c = prefetch.next;
+
+    prefetch_advance();
+
+    /* oversized commits are left to cache_pin() */
+    if (load_start(slot, c, false, prefetch_load_done))
+      return;
+
+    prefetch.done++;
+  }
+}
+
+static bool prefetch_in_flight(void)
+{
+  for (int i = 0; i < prefetch.nr_parallel; i++) {
+    if (prefetch.slots[i].commit)
+      return true;
+  }
+
+  return false;
+}
+
+static int prefetch_step(void)
+{
+  /* git show for the screen and a search runs before prefetching */
+  if (!screen_load.commit && !search_load.commit) {
+    for (int i = 0; i < prefetch.nr_parallel; i++) {
+      if (!prefetch.slots[i].commit)
+	prefetch_launch(&prefetch.slots[i]);
+    }
+  }
+
+  if (!prefetch.next && !prefetch_in_flight())
+    return 1;
+
+  prefetch_job.blocked = true;
+  return 0;
+}
+
+static void prefetch_compl(bool stopped)
+{
+  if (stopped) {
+    prefetch_cleanup();
+    return;
+  }
+
+  if (prefetch.budget_exceeded)
+    bmprintf("prefetch stopped by memory limit: %d/%d",
+	     prefetch.done, prefetch.total);
+  else
+    bmprintf("prefetched %s: %d/%d",
+	     prefetch.what, prefetch.done, prefetch.total);
+  prefetch_cleanup();
+}
+
+/* prefetch_update_bm(): show the progress unless an input is on the bottom */
+static void prefetch_update_bm(void)
+{
+  if (state != main_loop_state::DEFAULT
+      && strncmp(bottom_message, "prefetching ", 12))
+    return;
+
+  bmprintf("prefetching %s: %d/%d",
+	   prefetch.what, prefetch.done, prefetch.total);
+}
+
+static void prefetch_init_parallel(void)
+{
+  prefetch_stop();
+
+  if (!prefetch.nr_parallel) {
+    long nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    prefetch.nr_parallel = max(1L, min(nr_cpus, (long)PREFETCH_MAX_PARALLEL));
+  }
+}
+
+/* prefetch_start_list(): prefetch nr commits of list, list is taken over */
+static void prefetch_start_list(struct commit **list, int nr, const char *what)
+{
+  prefetch_init_parallel();
+
+  prefetch.list = list;
+  prefetch.nr_list = nr;
+  prefetch.list_pos = 0;
+  prefetch.what = what;
+  prefetch.done = 0;
+  prefetch.total = nr;
+  prefetch.budget_exceeded = false;
+
+  prefetch_advance();
+  job_start(&prefetch_job);
+
+  prefetch_update_bm();
+}
+
+static void prefetch_start(void)
+{
+  prefetch_init_parallel();
+
+  /* begin is older than end, so it is reachable from end via prev */
+  int total = 1;
+  struct commit *p;
+  for (p = range_end; p && p != range_begin; p = p->prev)
+    total++;
+
+  if (!p) {
+    bmprintf("range specified, but begin is newer than end");
+    return;
+  }
+
+  prefetch.next = range_end;
+  prefetch.what = "range";
+  prefetch.done = 0;
+  prefetch.total = total;
+  prefetch.budget_exceeded = false;
+
+  job_start(&prefetch_job);
+
+  prefetch_update_bm();
+}
+
+static int prefetch_load_done(struct commit_load *slot, bool aborted)
+{
+  prefetch.done++;
+
+  if (!aborted) {
+    if (mem_over_limit(slot->len, false)) {
+      /* don't evict commits of the range itself */
+      load_discard(slot);
+      prefetch.next = NULL;
+      prefetch.budget_exceeded = true;
+    } else
+      load_fill(slot);
+  }
+
+  prefetch_update_bm();
+
+  return 1;
+}
+
+static struct commit_load *find_load(struct commit *c)
+{
+  if (screen_load.commit == c)
+    return &screen_load;
+
+  if (search_load.commit == c)
+    return &search_load;
+
+  if (match_load.commit == c)
+    return &match_load;
+
+  for (int i = 0; i < prefetch.nr_parallel; i++) {
+    if (prefetch.slots[i].commit == c)
+      return &prefetch.slots[i];
+  }
+
+  return NULL;
+}
+
+#define NR_LOADS (3 + PREFETCH_MAX_PARALLEL)
+
+static struct commit_load *nth_load(int i)
+{
+  switch (i) {
+  case 0:
+    return &screen_load;
+  case 1:
+    return &search_load;
+  case 2:
+    return &match_load;
+  default:
+    return &prefetch.slots[i - 3];
+  }
+}
+
+static int loads_pollfds(struct pollfd *pfds)
+{
+  for (int i = 0; i < NR_LOADS; i++) {
+    struct commit_load *l = nth_load(i);
+
+    pfds[i].fd = l->commit ? l->fd : -1;
+    pfds[i].events = POLLIN;
+    pfds[i].revents = 0;
+  }
+
+  return NR_LOADS;
+}
+
+/* loads_timeout(): ms until a time budget of the loads runs out, or -1 */
+static int loads_timeout(void)
+{
+  int timeout = -1;
+
+  for (int i = 0; i < NR_LOADS; i++) {
+    int t = load_timeout(nth_load(i));
+
+    if (0 <= t && (timeout < 0 || t < timeout))
+      timeout = t;
+  }
+
+  return timeout;
+}
+
+/* return 1 when the screen should be updated */
+static int loads_handle_pollfds(struct pollfd *pfds)
+{
+  int ret = 0;
+
+  for (int i = 0; i < NR_LOADS; i++) {
+    struct commit_load *l = nth_load(i);
+
+    if (l->commit)
+      load_check_time(l);
+
+    if (!l->commit || !(pfds[i].revents & (POLLIN | POLLHUP)))
+      continue;
+
+    ret |= load_progress(l);
+  }
+
+  return ret;
+}
+
+enum class range_state {
+  INIT,
+  BEGIN_SPECIFIED,
+  END_SPECIFIED,
+  SPECIFIED
+};
+static range_state range_state = range_state::INIT;
+
+static int specify_range(char cmd)
+{
+  int begin_set, end_set;
+
+  begin_set = end_set = 0;
+
+  switch (range_state) {
+  case range_state::INIT:
+    if (cmd == '[') {
+      range_begin = current;
+      range_state = range_state::BEGIN_SPECIFIED;
+
+      begin_set = 1;
+    } else {
+      assert(cmd == ']');
+
+      range_end = current;
+      range_state = range_state::END_SPECIFIED;
+
+      end_set = 1;
+    }
+
+    break;
+  case range_state::BEGIN_SPECIFIED:
+    if (cmd == '[') {
+      range_begin = current;
+      range_state = range_state::BEGIN_SPECIFIED;
+
+      begin_set = 1;
+    } else {
+      assert(cmd == ']');
+
+      range_end = current;
+      range_state = range_state::SPECIFIED;
+
+      end_set = 1;
+    }
+
+    break;
+  case range_state::END_SPECIFIED:
+    if (cmd == '[') {
+      range_begin = current;
+      range_state = range_state::SPECIFIED;
+
+      begin_set = 1;
+    } else {
+      assert(cmd == ']');
+
+      range_end = current;
+      range_state = range_state::END_SPECIFIED;
+
+      end_set = 1;
+    }
+
+    break;
+  case range_state::SPECIFIED:
+    if (cmd == '[') {
+      range_begin = current;
+      begin_set = 1;
+    } else {
+      assert(cmd == ']');
+      range_end = current;
+      end_set = 1;
+    }
+
+    break;
+  default:
+    fprintf(stderr, "invalid state: %d\n", range_state);
+    exit(1);
+    break;
+  }
+
+  if (range_state == range_state::SPECIFIED) {
+    bmprintf("range specified");
+    prefetch_start();
+    if (match_list.active)
+      match_list_start();
+    return 1;
+  }
+
+  if (begin_set)
+    bmprintf("begin of range specified");
+  else if (end_set)
+    bmprintf("end of range specified");
+  else
+    return 0;
+
+  return 1;
+}
+
+static int clear_range(char cmd)
+{
+  range_begin = range_end = NULL;
+  range_state = range_state::INIT;
+
+  if (job_running(&prefetch_job))
+    prefetch_stop();
+
+  if (match_list.active)
+    match_list_start();
+
+  bmprintf("range cleared");
+
+  return 1;
+}
+
+static int search_with_filter(char cmd)
+{
+  bmprintf("input search filter(m(modified), a(at line), l(commit message), f(file header)): ");
+  if (cmd == ',')
+    state = main_loop_state::INPUT_SEARCH_FILTER;
+  else
+    state = main_loop_state::INPUT_SEARCH_FILTER2;
+
+  return 1;
+}
+
+static int stop_search(char cmd)
+{
+  if (cancel_screen_load())
     return 1;
+
+  if (state == main_loop_state::SEARCHING_QUERY) {
+    state = main_loop_state::DEFAULT;
+    memset(bottom_message, 0, bottom_message_size);
+    match_list_stop();
+  }
+
+  return 1;
+}
+
+static int clipboard_pid;
+
+char *copy_with_editor(struct commit *c, int *buf_len)
+{
+  struct commit_cached *cached = cache_pin(c);
+  char tmp_path[PATH_MAX];
+
+  strcpy(tmp_path, "/tmp/gitless-yank-XXXXXX");
+  mkstemp(tmp_path);
+
+  int tmp_fd = open(tmp_path, O_WRONLY);
+  if (tmp_fd < 0)
+    die("open() failed\n");
+
+  write_all(tmp_fd, cached->text, cached->text_size);
+  close(tmp_fd);
+  cache_unpin(c);
+
+  char *env_editor = getenv("EDITOR");
+  int editor_pid = fork();
+  switch (editor_pid) {
+  case 0:
+    execlp(env_editor, env_editor, tmp_path, NULL);
+    break;
+  case -1:
+    die("fork() failed\n");
+    break;
   default:
-    retry = true;
-    goto retry_cover_letter;
+    waitpid(editor_pid, NULL, 0);
+    break;
+  }
+
+  tmp_fd = open(tmp_path, O_RDONLY);
+  struct stat tmp_stat;
+
+  memset(&tmp_stat, 0, sizeof(tmp_stat));
+  int fret = fstat(tmp_fd, &tmp_stat);
+  if (fret < 0)
+    die("fstat() failed\n");
+
+  char *ret = static_cast<char *>(xalloc(tmp_stat.st_size));
+  int rbytes = 0;
+  do {
+    int rret = read(tmp_fd, ret + rbytes, tmp_stat.st_size - rbytes);
+    if (rret < 0)
+      die("read() failed\n");
+    rbytes += rret;
+  } while (rbytes < tmp_stat.st_size);
+  close(tmp_fd);
+  unlink(tmp_path);
+
+  *buf_len = tmp_stat.st_size;
+  return ret;
+}
+
+void yank_with_xclip(char *buf, int buf_len, const char *board) {
+  int pipefds[2];
+
+  if (pipe(pipefds))
+    die("pipe() failed\n");
+
+  int xclip_pid = fork();
+  switch (xclip_pid) {
+  case 0:
+    break;
+  case -1:
+    die("fork() failed\n");
+    break;
+  default:
+    close(pipefds[0]);
+
+    int wbytes = 0;
+    do {
+      int wret = write(pipefds[1], buf + wbytes, buf_len - wbytes);
+      if (wret < 0)
+	die("write() failed\n");
+      wbytes += wret;
+    } while (wbytes < buf_len);
+    close(pipefds[1]);
+
+    return;
+  }
+
+  close(0);
+  dup(pipefds[0]);
+  close(pipefds[1]);
+  if (execlp("xclip", "xclip", "-i", "-selection", board, NULL))
+    die("execlp() failed\n");
+}
+
+/* commit_ticket(): the first ticket in the message of c, "" if none */
+static string commit_ticket(struct commit *c)
+{
+  struct commit_cached *cached = cache_pin(c);
+  string ticket;
+
+  for (int i = 0; i < cached->nr_lines && ticket.empty(); i++) {
+    if (cached->line_classes[i] != line_class::MESSAGE)
+      continue;
+
+    const char *begin;
+    char *line = cached->lines[i];
+    int nli = ret_nl_index(line), len;
+    line[nli] = '\0';
+    if ((len = ticket_match(line, &begin)))
+      ticket.assign(begin, len);
+    line[nli] = '\n';
+  }
+
+  cache_unpin(c);
+
+  return ticket;
+}
+
+/* ticket_jump(): jump to the older (t) or newer (T) commit of the ticket */
+static int ticket_jump(char cmd)
+{
+  if (file_history_path) {
+    bmprintf("tickets are indexed only in the entire history");
+    return 1;
+  }
+
+  string ticket = commit_ticket(current);
+  if (ticket.empty()) {
+    bmprintf("this commit doesn't have a ticket number");
+    return 1;
+  }
+
+  if (current->log_idx < 0) {
+    bmprintf("position of this commit in the history is unknown yet");
+    return 1;
+  }
+
+  ticket_stream_start();
+
+  /*
+   * current is indexed when it is filled. it isn't if it was filled before
+   * its position was known (e.g. the root found by git rev-list).
+   */
+  cache_pin(current);
+  pthread_mutex_lock(&cache_lock);
+  const vector<int> *found = ticket_index_lookup(ticket.c_str());
+  if (!found
+      || !binary_search(found->begin(), found->end(), current->log_idx)) {
+    index_commit_tickets(current);
+    found = ticket_index_lookup(ticket.c_str());
+  }
+  const vector<int> commits_copied = found ? *found : vector<int>();
+  pthread_mutex_unlock(&cache_lock);
+  cache_unpin(current);
+
+  const vector<int> *commits = &commits_copied;
+  auto it = lower_bound(commits->begin(), commits->end(), current->log_idx);
+  const char *indexing = ticket_stream.done ? "" : " (indexing...)";
+
+  if (cmd == 't') {
+    if (it == commits->end() || ++it == commits->end()) {
+      bmprintf("%s: no older commit%s", ticket.c_str(), indexing);
+      return 1;
+    }
+  } else {
+    if (it == commits->begin()) {
+      bmprintf("%s: no newer commit%s", ticket.c_str(), indexing);
+      return 1;
+    }
+    --it;
+  }
+
+  int target = *it;
+  size_t nth = it - commits->begin() + 1, nr = commits->size();
+
+  if (!jump_to_log_idx(target))
+    return 0;
+
+  if (target < nr_read_commits)
+    bmprintf("%s: commit %zu of %zu%s", ticket.c_str(), nth, nr, indexing);
+
+  return 1;
+}
+
+static int yank(char cmd)
+{
+  if (clipboard_pid)
+    kill(clipboard_pid, SIGKILL);
+
+  char yank_target;
+  move(row, 0);
+  printw("yank what? c (commit ID), j (ticket if exists), e (entire with editor) :");
+  refresh();
+
+  int ret = read(tty_fd, &yank_target, 1);
+  if (ret != 1)
+    die("read() failed\n");
+
+  char *copy_buf;
+  int copy_buf_len;
+
+  switch (yank_target) {
+  case 'c':
+    copy_buf = strdup(current->commit_id);
+    copy_buf_len = 41;
+    break;
+  case 'e':
+    copy_buf = copy_with_editor(current, &copy_buf_len);
+    break;
+  case 'j':
+    {
+      string ticket = commit_ticket(current);
+      if (ticket.size() == 0) {
+	bmprintf("this commit doesn't have a ticket number\n");
+	return 1;
+      }
+      copy_buf = strdup(ticket.c_str());
+      copy_buf_len = ticket.size() + 1;
+    }
+    break;
+  default:
+    bmprintf("unknown yank target: %c\n", yank_target);
+    return 1;
   }
 
-  char prefix[32];
-  int prefix_i = 0;
-  memset(prefix, 0, 32);
- read_prefix:
-  move(row, 0);
-  for (int i = 0; i < col; i++) printw(" ");
-  move(row, 0);
-  printw("prefix of the patchset%s: %s", prefix_i == 31 ? "max" : "", prefix);
-  refresh();
+  yank_with_xclip(copy_buf, copy_buf_len, "CLIPBOARD");
+  yank_with_xclip(copy_buf, copy_buf_len, "PRIMARY");
 
-  ret = read(tty_fd, &key, 1);
-  if (ret != 1)
-    die("read() failed");
+  free(copy_buf);
 
-  if (key == (char)0x7f) {
-    /* backspace */
-    if (prefix_i)
-      prefix[--prefix_i] = '\0';
-    goto read_prefix;
-  } else if (key == (char)0xd) {
-    /* enter */
-    goto end_read_prefix;
-  } else if (key == 0x1b) {
-    /* escape, cancel of format-patch */
-    return 1;
-  }
+  return 1;
+}
+
+static int help(char cmd)
+{
+  help_head = 0;
+  state = main_loop_state::HELP;
+  return 1;
+}
 
+struct key_cmd {
+  char key;
+  int (*op)(char);
+};
 
-  if (prefix_i == 31) {
-    /* prefix is too long, simply ignore the inputted char */
-    goto read_prefix;
+static struct key_cmd valid_ops[] = {
+#define cmd(cmd, func, desc) { cmd, func },
+#include "default_cmd.def"
+#undef cmd
+  { '\0', NULL },
+};
+
+static int search_filter_modified_line(char cmd)
+{
+  match_filter = line_class_bit(line_class::ADDED)
+    | line_class_bit(line_class::REMOVED);
+  current_match_type = match_type::MODIFIED;
+
+  if (state == main_loop_state::INPUT_SEARCH_FILTER2) {
+    state = main_loop_state::INPUT_SEARCH_DIRECTION;
+    return search(1, 1);
   }
 
-  prefix[prefix_i++] = key;
+  state = main_loop_state::INPUT_SEARCH_DIRECTION;
 
-  goto read_prefix;
+  bmprintf("type: %s, input search direction (/, ?, \\, !):",
+	   current_match_type_str());
 
- end_read_prefix:
-  endwin();
-  printf("executing git... good luck!\n");
-  fflush(stdout);
+  return 1;
+}
 
-  if (!force) {
-    /* FIXME: how should I treat a case of IP unreachable? */
-    pid_t pid = fork();
-    switch (pid) {
-    case -1:
-      die("fork() failed\n");
-      break;
-    case 0:;
-      int pid2;
-      pid2 = fork();
-      switch (pid2) {
-      case 0:
-	execlp("git", "git", "remote", "update", NULL);
-	break;
-      case -1:
-	die("fork() failed\n");
-	break;
-      default:
-	waitpid(pid2, NULL, 0);
-	break;
-      }
-      /* FIXME: "origin/master" is always suitable? */
-      execlp("git", "git", "rebase", "origin/master", NULL);
-      break;
-    default:;
-      int status;
-      waitpid(pid, &status, 0);
-      if (WEXITSTATUS(status)) {
-	/* if rebase found something, it returns 1 */
-	printf("rebase found something, you should check before posting patch!\n");
-	exit(0);
-      }
+static int search_filter_at_line(char cmd)
+{
+  match_filter = line_class_bit(line_class::HUNK_HEADER);
+  current_match_type = match_type::AT;
 
-      break;
-    }
+  if (state == main_loop_state::INPUT_SEARCH_FILTER2) {
+    state = main_loop_state::INPUT_SEARCH_DIRECTION;
+    return search(1, 1);
   }
 
-  static char *execvp_args[6];
-  int execvp_args_i = 0;
-  execvp_args[execvp_args_i++] = const_cast<char *>("git");
-  execvp_args[execvp_args_i++] = const_cast<char *>("format-patch");
-  if (need_cover_letter)
-    execvp_args[execvp_args_i++] = const_cast<char *>("--cover-letter");
-  if (strlen(prefix)) {
-    static char subject_prefix[64];
-    snprintf(subject_prefix, 64, "--subject-prefix=%s", prefix);
-    execvp_args[execvp_args_i++] = subject_prefix;
-  }
-  execvp_args[execvp_args_i++] = const_cast<char *>("-C");
-  execvp_args[execvp_args_i++] = range;
-  execvp_args[execvp_args_i++] = NULL;
+  state = main_loop_state::INPUT_SEARCH_DIRECTION;
 
-  execvp("git", execvp_args);
-  die("execvp() failed\n");
+  bmprintf("type: %s, input search direction (/, ?, \\, !):",
+	   current_match_type_str());
 
-  /* never reach */
   return 1;
 }
 
-static int git_rebase_i(void)
+static int search_filter_commit_message(char cmd)
 {
-  struct commit *prev = get_prev_or_current(current);
+  match_filter = line_class_bit(line_class::MESSAGE);
+  current_match_type = match_type::COMMIT_MESSAGE;
 
-  endwin();
-  printf("executing git... good luck!\n");
-  fflush(stdout);
+  if (state == main_loop_state::INPUT_SEARCH_FILTER2) {
+    state = main_loop_state::INPUT_SEARCH_DIRECTION;
+    return search(1, 1);
+  }
 
-  close(stdin_fd);
-  stdin_fd = open("/dev/tty", O_RDONLY);
-  if (stdin_fd != 0)
-    die("failed to open /dev/tty\n");
+  state = main_loop_state::INPUT_SEARCH_DIRECTION;
 
-  close(1);
-  int stdout_fd = open("/dev/tty", O_WRONLY);
-  if (stdout_fd != 1)
-    die("failed to open /dev/tty]n\n");
-  execlp("git", "git", "rebase", "-i", prev->commit_id, NULL);
-  die("execlp() failed\n");
+  bmprintf("type: %s, input search direction (/, ?, \\, !):",
+	   current_match_type_str());
 
-  /* never reach */
   return 1;
 }
 
-static int git_bisect(void)
+static int search_filter_file_line(char cmd)
 {
-  if (!range_begin || !range_end) {
-    bmprintf("bisect begin and end are required before format-patch");
-    state = main_loop_state::DEFAULT;
+  match_filter = line_class_bit(line_class::FILE_HEADER);
+  current_match_type = match_type::FILE;
 
-    return 1;
+  if (state == main_loop_state::INPUT_SEARCH_FILTER2) {
+    state = main_loop_state::INPUT_SEARCH_DIRECTION;
+    return search(1, 1);
   }
 
-  struct commit *prev_range_begin = get_prev_or_current(range_begin);
+  state = main_loop_state::INPUT_SEARCH_DIRECTION;
 
-  endwin();
+  bmprintf("type: %s, input search direction (/, ?, \\, !):",
+	   current_match_type_str());
 
-  execlp("git", "git", "bisect", "start",
-	 range_end->commit_id, prev_range_begin->commit_id, NULL);
-  die("execlp() failed\n");
+  return 1;
+}
+
+static int search_filter_cancel(char cmd)
+{
+  match_filter = LINE_CLASS_ALL;
+  current_match_type = match_type::DEFAULT;
+  state = main_loop_state::DEFAULT;
 
-  /* never reach */
   return 1;
 }
 
-static int git_revert(void)
+static int search_filter_invalid(char cmd)
 {
-  endwin();
-  execlp("git", "git", "revert", current->commit_id, NULL);
-  die("execlp() failed\n");
+  bmprintf("invalid search type: %c\n", cmd);
+  match_filter = LINE_CLASS_ALL;
+  current_match_type = match_type::DEFAULT;
+  state = main_loop_state::DEFAULT;
 
-  /* never reach */
   return 1;
 }
 
-static char checkout_branch_name[1024];
-static int branch_name_idx;
+static struct key_cmd search_filter_ops[] = {
+  { 'm', search_filter_modified_line },
+  { 'a', search_filter_at_line },
+  { 'l', search_filter_commit_message },
+  { 'f', search_filter_file_line },
 
-static void git_checkout_b(void)
+  { 0x1b, search_filter_cancel },
+
+  { '\0', NULL },
+};
+
+static int search_direction_cancel(char cmd)
+{
+  match_filter = LINE_CLASS_ALL;
+  current_match_type = match_type::DEFAULT;
+  state = main_loop_state::DEFAULT;
+
+  return 1;
+}
+
+static int search_direction_invalid(char cmd)
+{
+  bmprintf("invalid direction specifier: %c\n", cmd);
+  state = main_loop_state::DEFAULT;
+  return 1;
+}
+
+static struct key_cmd search_direction_ops[] = {
+  { '/', search_global_forward },
+  { '?', search_global_backward },
+  { '\\', search_local_forward },
+  { '!', search_local_backward },
+
+  { 0x1b, search_direction_cancel },
+
+  { '\0', NULL },
+};
+
+static int (*ops_array[256])(char);
+static int (*search_filter_ops_array[256])(char);
+static int (*search_direction_ops_array[256])(char);
+
+static void exit_handler(void)
 {
+  debug_print_mem_usage("exit");
+
+  /* git log of the commit list can be still running */
+  commit_list_reset();
+
+  addch('\n');
+
+  if (clipboard_pid)
+    kill(clipboard_pid, SIGKILL);
+
   endwin();
-  printf("executing git... good luck\n");
-  fflush(stdout);
 
-  /* TODO: check existence of branch here, before execlp() */
-  execlp("git", "git", "checkout", "-b",
-	 checkout_branch_name, current->commit_id, NULL);
-  die("execlp() failed\n");
+  fprintf(stderr, dying_msg);
+}
+
+/*
+ * live update: HEAD and refs are watched with inotify. after a change, git log
+ * is read again until it reaches a commit already read (the junction). new
+ * commits are prepended in front of it, commits newer than the junction in
+ * the old history aren't reachable anymore and are invalidated. cached texts
+ * of the others are kept.
+ */
+#define REFS_SETTLE_MS 200
+/* new commits read at once beyond the old history */
+#define HISTORY_UPDATE_MAX 4096
+
+static int watch_fd = -1;
+static bool refs_changed;
+static struct timespec refs_changed_at;
+
+static void init_watch(void)
+{
+  char *head_path = git_path("HEAD"), *refs_path = git_path("refs");
+
+  if (head_path && refs_path) {
+    *strrchr(head_path, '/') = '\0';
+    *strrchr(refs_path, '/') = '\0';
+    watch_fd = watch_refs(head_path, refs_path);
+  }
+
+  free(head_path);
+  free(refs_path);
 }
 
-static int launch_git_command(char cmd)
+static int pressure_pollfd(struct pollfd *pfd)
 {
-  bmprintf("launch git command f (format-patch), r (rebase -i), c(checkout -b), b(bisect):");
-  state = main_loop_state::LAUNCH_GIT_COMMAND;
+  pfd->fd = pressure_fd;
+  pfd->events = POLLPRI;
+  pfd->revents = 0;
+
   return 1;
 }
 
-static int show_changed_files(char cmd)
+static void pressure_handle_pollfd(struct pollfd *pfd)
 {
-  state = main_loop_state::SHOW_CHANGED_FILES;
-  return 1;
+  if (pfd->revents & POLLERR) {
+    /* e.g. the cgroup is removed */
+    close(pressure_fd);
+    pressure_fd = -1;
+    return;
+  }
+
+  if (pfd->revents & POLLPRI)
+    shrink_cache();
+  else
+    recover_alloc_lim();
 }
 
-static int quit(char cmd)
+static int watch_pollfd(struct pollfd *pfd)
 {
-  running = false;
-  return 0;
+  pfd->fd = watch_fd;
+  pfd->events = POLLIN;
+  pfd->revents = 0;
+
+  return 1;
 }
 
-enum class range_state {
-  INIT,
-  BEGIN_SPECIFIED,
-  END_SPECIFIED,
-  SPECIFIED
-};
-static range_state range_state = range_state::INIT;
+static void watch_handle_pollfd(struct pollfd *pfd)
+{
+  if (!(pfd->revents & POLLIN) || !watch_refs_changed())
+    return;
 
-static int specify_range(char cmd)
+  /* refs are often updated in a burst, e.g. by git fetch */
+  refs_changed = true;
+  clock_gettime(CLOCK_MONOTONIC, &refs_changed_at);
+}
+
+/* refs_settle_timeout(): ms until the history is updated, -1 if not needed */
+static int refs_settle_timeout(void)
 {
-  int begin_set, end_set;
+  if (!refs_changed)
+    return -1;
 
-  begin_set = end_set = 0;
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
 
-  switch (range_state) {
-  case range_state::INIT:
-    if (cmd == '[') {
-      range_begin = current;
-      range_state = range_state::BEGIN_SPECIFIED;
+  long elapsed = (now.tv_sec - refs_changed_at.tv_sec) * 1000
+    + (now.tv_nsec - refs_changed_at.tv_nsec) / 1000000;
 
-      begin_set = 1;
-    } else {
-      assert(cmd == ']');
+  return elapsed < REFS_SETTLE_MS ? REFS_SETTLE_MS - elapsed : 0;
+}
 
-      range_end = current;
-      range_state = range_state::BEGIN_SPECIFIED;
+/* the chain isn't touched while it is walked or another one is shown */
+static bool history_updatable(void)
+{
+  return !jobs_foreground() && !file_history_path
+    && (state == main_loop_state::DEFAULT
+	|| state == main_loop_state::SEARCHING_QUERY);
+}
 
-      end_set = 1;
-    }
+static void invalidate_commit(struct commit *c)
+{
+  if (c->cached.state == commit_cached_state::LOADING)
+    load_cancel(find_load(c));
 
-    break;
-  case range_state::BEGIN_SPECIFIED:
-    if (cmd == '[') {
-      range_begin = current;
-      range_state = range_state::BEGIN_SPECIFIED;
+  c->prev = c->next = NULL;
+  c->log_idx = -1;
+  c->gone = true;
+}
 
-      begin_set = 1;
-    } else {
-      assert(cmd == ']');
+/*
+ * free_gone_commits(): free commits dropped from the history once scans and
+ * prefetches are stopped. a pinned one (e.g. on the screen) is freed by
+ * cache_unpin().
+ */
+static void free_gone_commits(const vector<struct commit *> &gone)
+{
+  pthread_mutex_lock(&cache_lock);
+  for (struct commit *c : gone) {
+    if (!c->cached.pins)
+      free_commit(c);
+  }
+  pthread_mutex_unlock(&cache_lock);
+}
 
-      range_end = current;
-      range_state = range_state::SPECIFIED;
+/* reindex_cached_tickets(): index cached commits again with new positions */
+static void reindex_cached_tickets(void)
+{
+  pthread_mutex_lock(&cache_lock);
+  for (struct commit *p = head; p; p = p->prev) {
+    if (p->cached.state == commit_cached_state::FILLED)
+      index_commit_tickets(p);
+  }
+  pthread_mutex_unlock(&cache_lock);
+}
 
-      end_set = 1;
+static void history_update(void)
+{
+  refs_changed = false;
+
+  unordered_map<string, struct commit *> read_commits;
+  for (struct commit *p = head; p; p = p->prev)
+    read_commits[p->commit_id] = p;
+
+  int fd;
+  pid_t pid = launch_git_log_records(&fd);
+  struct log_buf *buf = alloc_log_buf();
+
+  /* newer ones come first */
+  vector<struct commit *> new_commits;
+  struct commit *junction = NULL;
+  struct log_record record;
+  bool end = false;
+
+  /* without a junction, the new git log is read lazily like the old one */
+  while (!end && (int)new_commits.size() < nr_read_commits + HISTORY_UPDATE_MAX
+	 && read_log_record(fd, buf, &record, &end)) {
+    auto it = read_commits.find(record.commit_id);
+    if (it != read_commits.end()) {
+      junction = it->second;
+      break;
     }
 
-    break;
-  case range_state::END_SPECIFIED:
-    if (cmd == '[') {
-      range_begin = current;
-      range_state = range_state::SPECIFIED;
+    struct commit *c = alloc_commit(record.commit_id);
+    set_commit_metadata(c, &record);
+    new_commits.push_back(c);
+  }
 
-      begin_set = 1;
-    } else {
-      assert(cmd == ']');
+  if (junction) {
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    close(fd);
+    free_log_buf(buf);
+  }
 
-      range_end = current;
-      range_state = range_state::END_SPECIFIED;
+  if (junction == head && new_commits.empty())
+    return;
 
-      end_set = 1;
-    }
+  if (!junction && new_commits.empty()) {
+    /* e.g. the branch is deleted, the old history is kept */
+    waitpid(pid, NULL, 0);
+    close(fd);
+    free_log_buf(buf);
+    bmprintf("history became empty, kept the old one");
+    return;
+  }
 
-    break;
-  case range_state::SPECIFIED:
-    if (cmd == '[') {
-      range_begin = current;
-      begin_set = 1;
-    } else {
-      assert(cmd == ']');
-      range_end = current;
-      end_set = 1;
+  /* the old history is read from the new git log from now */
+  if (!junction) {
+    close(stdin_fd);
+    stdin_fd = fd;
+    free_log_buf(log_buf);
+    log_buf = buf;
+    read_end = end;
+  }
+
+  int nr_new = new_commits.size(), nr_gone = 0;
+  vector<struct commit *> gone;
+  for (struct commit *p = head; p != junction; nr_gone++) {
+    struct commit *older = p->prev;
+
+    if (p == current)
+      current = NULL;
+    if (p == orig_place.commit)
+      orig_place.commit = NULL;
+    if (p == range_begin || p == range_end) {
+      range_begin = range_end = NULL;
+      range_state = range_state::INIT;
     }
+    if (p == root)
+      root = NULL;
 
-    break;
-  default:
-    fprintf(stderr, "invalid state: %d\n", range_state);
-    exit(1);
-    break;
+    invalidate_commit(p);
+    gone.push_back(p);
+    p = older;
   }
 
-  if (range_state == range_state::SPECIFIED) {
-    bmprintf("range specified");
-    return 1;
+  struct commit *older = junction;
+  for (int i = nr_new - 1; 0 <= i; i--) {
+    struct commit *c = new_commits[i];
+
+    c->prev = older;
+    if (older)
+      older->next = c;
+    else
+      tail = c;
+    older = c;
   }
+  head = older;
+  head->next = NULL;
 
-  if (begin_set)
-    bmprintf("begin of range specified");
-  else if (end_set)
-    bmprintf("end of range specified");
-  else
-    return 0;
+  nr_read_commits = 0;
+  for (struct commit *p = head; p; p = p->prev)
+    p->log_idx = nr_read_commits++;
 
-  return 1;
+  if (!current)
+    current = head;
+  last_shown = load_canceled = NULL;
+
+  /* positions and hits are changed */
+  if (job_running(&prefetch_job))
+    prefetch_stop();
+  if (match_list.active)
+    match_list_start();
+  free_gone_commits(gone);
+  ticket_stream_reset();
+  reindex_cached_tickets();
+  commit_list_reset();
+
+  if (read_end) {
+    nr_history = nr_read_commits;
+    nr_history_estimated = false;
+  } else if (0 < nr_history)
+    nr_history += nr_new - nr_gone;
+
+  if (history_count.fd == -1 && !read_end) {
+    history_count.len = 0;
+    history_count.pid = launch_git_rev_list("--count", &history_count.fd);
+    fcntl(history_count.fd, F_SETFL,
+	  fcntl(history_count.fd, F_GETFL) | O_NONBLOCK);
+  }
+
+  if (!junction)
+    bmprintf("history is rewritten, reading it again");
+  else if (nr_gone)
+    bmprintf("history updated: %d new commits, %d commits gone",
+	     nr_new, nr_gone);
+  else
+    bmprintf("history updated: %d new commits", nr_new);
 }
 
-static int clear_range(char cmd)
-{
-  range_begin = range_end = NULL;
-  range_state = range_state::INIT;
+/*
+ * batch search: --grep runs a global regex search over the history without
+ * the terminal. git show runs for as many commits at once as there are
+ * cores, hits are printed in the order of git log.
+ */
+#define BATCH_MAX_PARALLEL 64
+/* commits loaded ahead of the oldest one not printed yet, per slot */
+#define BATCH_WINDOW_PER_SLOT 4
+
+static const char *batch_grep;
+static bool batch_json;
+
+static const struct {
+  const char *name;
+  unsigned int classes;
+} batch_filters[] = {
+  { "default", LINE_CLASS_ALL },
+  { "modified",
+    line_class_bit(line_class::ADDED) | line_class_bit(line_class::REMOVED) },
+  { "at", line_class_bit(line_class::HUNK_HEADER) },
+  { "commit", line_class_bit(line_class::MESSAGE) },
+  { "file", line_class_bit(line_class::FILE_HEADER) },
+};
 
-  bmprintf("range cleared");
+static bool set_batch_filter(const char *name)
+{
+  for (size_t i = 0; i < sizeof(batch_filters) / sizeof(batch_filters[0]); i++) {
+    if (!strcmp(batch_filters[i].name, name)) {
+      match_filter = batch_filters[i].classes;
+      return true;
+    }
+  }
 
-  return 1;
+  return false;
 }
 
-static int search_with_filter(char cmd)
+static void print_json_string(const char *s)
 {
-  bmprintf("input search filter(m(modified), a(at line), f(+++, ---): ");
-  if (cmd == ',')
-    state = main_loop_state::INPUT_SEARCH_FILTER;
-  else
-    state = main_loop_state::INPUT_SEARCH_FILTER2;
+  putchar('"');
 
-  return 1;
-}
+  for (; *s; s++) {
+    unsigned char ch = *s;
 
-static int stop_search(char cmd)
-{
-  if (state == main_loop_state::SEARCHING_QUERY) {
-    state = main_loop_state::DEFAULT;
-    memset(bottom_message, 0, bottom_message_size);
+    if (ch == '"' || ch == '\\')
+      printf("\\%c", ch);
+    else if (ch == '\t')
+      printf("\\t");
+    else if (ch < 0x20 || ch == 0x7f)
+      printf("\\u%04x", ch);
+    else
+      putchar(ch);
   }
 
-  return 1;
+  putchar('"');
 }
 
-static int clipboard_pid;
-
-char *copy_with_editor(struct commit *c, int *buf_len)
+/* batch_print_hits(): return the number of matched lines of c */
+static int batch_print_hits(struct commit *c)
 {
-  struct commit_cached *cached = get_cached(c);
-  char tmp_path[PATH_MAX];
+  struct commit_cached *cached = raw_get_cached(c);
+  int nr_hits = 0;
 
-  strcpy(tmp_path, "/tmp/gitless-yank-XXXXXX");
-  mkstemp(tmp_path);
+  for (int i = 0; i < cached->nr_lines; i++) {
+    if (!(match_filter & line_class_bit(cached->line_classes[i])))
+      continue;
 
-  int tmp_fd = open(tmp_path, O_WRONLY);
-  if (tmp_fd < 0)
-    die("open() failed\n");
+    char *line = cached->lines[i];
+    int nli = ret_nl_index(line);
+    line[nli] = '\0';
 
-  int wbytes = 0;
-  do {
-    int wret = write(tmp_fd, cached->text + wbytes, cached->text_size - wbytes);
-    if (wret < 0)
-      die("write() failed\n");
-    wbytes += wret;
-  } while (wbytes < cached->text_size);
-  close(tmp_fd);
+    if (match_line(line)) {
+      if (batch_json) {
+	printf("{\"commit\":\"%s\",\"line\":%d,\"text\":", c->commit_id, i + 1);
+	print_json_string(line);
+	printf("}\n");
+      } else
+	printf("%s:%d:%s\n", c->commit_id, i + 1, line);
 
-  char *env_editor = getenv("EDITOR");
-  int editor_pid = fork();
-  switch (editor_pid) {
-  case 0:
-    execlp(env_editor, env_editor, tmp_path, NULL);
-    break;
-  case -1:
-    die("fork() failed\n");
-    break;
-  default:
-    waitpid(editor_pid, NULL, 0);
-    break;
+      nr_hits++;
+    }
+
+    line[nli] = '\n';
   }
 
-  tmp_fd = open(tmp_path, O_RDONLY);
-  struct stat tmp_stat;
+  cache_unpin(c);
+  evict_commit(c);
 
-  memset(&tmp_stat, 0, sizeof(tmp_stat));
-  int fret = fstat(tmp_fd, &tmp_stat);
-  if (fret < 0)
-    die("fstat() failed\n");
+  return nr_hits;
+}
 
-  char *ret = static_cast<char *>(xalloc(tmp_stat.st_size));
-  int rbytes = 0;
-  do {
-    int rret = read(tmp_fd, ret + rbytes, tmp_stat.st_size - rbytes);
-    if (rret < 0)
-      die("read() failed\n");
-    rbytes += rret;
-  } while (rbytes < tmp_stat.st_size);
-  close(tmp_fd);
-  unlink(tmp_path);
+/* texts are pinned until printed, the budget can't evict them before it */
+static int batch_load_done(struct commit_load *l, bool aborted)
+{
+  struct commit *c = l->commit;
 
-  *buf_len = tmp_stat.st_size;
-  return ret;
+  /* batch loads spill oversized texts instead of aborting */
+  assert(!aborted);
+  load_fill(l);
+  cache_pin(c);
+
+  return 0;
 }
 
-void yank_with_xclip(char *buf, int buf_len, const char *board) {
-  int pipefds[2];
+static struct commit *batch_older_commit(struct commit *c)
+{
+  if (!c->prev)
+    read_commit();
 
-  if (pipe(pipefds))
-    die("pipe() failed\n");
+  return c->prev;
+}
 
-  int xclip_pid = fork();
-  switch (xclip_pid) {
-  case 0:
-    break;
-  case -1:
-    die("fork() failed\n");
-    break;
-  default:
-    close(pipefds[0]);
+/* batch_search(): return the exit status, 0 if any line matched like grep */
+static int batch_search(void)
+{
+  static struct commit_load slots[BATCH_MAX_PARALLEL];
+  struct pollfd pfds[BATCH_MAX_PARALLEL];
 
-    int wbytes = 0;
-    do {
-      int wret = write(pipefds[1], buf + wbytes, buf_len - wbytes);
-      if (wret < 0)
-	die("write() failed\n");
-      wbytes += wret;
-    } while (wbytes < buf_len);
-    close(pipefds[1]);
+  long nr_slots = sysconf(_SC_NPROCESSORS_ONLN);
+  nr_slots = max(1L, min(nr_slots, (long)BATCH_MAX_PARALLEL));
 
-    return;
+  read_commit();
+
+  /* commits before next_load are launched, before next_print are printed */
+  struct commit *next_load = head, *next_print = head;
+  int nr_ahead = 0;
+  long nr_hits = 0;
+
+  while (next_print) {
+    for (int i = 0; i < nr_slots; i++) {
+      if (slots[i].commit || !next_load
+	  || nr_slots * BATCH_WINDOW_PER_SLOT <= nr_ahead)
+	continue;
+
+      load_start(&slots[i], next_load, true, batch_load_done);
+      next_load = batch_older_commit(next_load);
+      nr_ahead++;
+    }
+
+    if (next_print != next_load
+	&& next_print->cached.state != commit_cached_state::LOADING) {
+      nr_hits += batch_print_hits(next_print);
+      next_print = batch_older_commit(next_print);
+      nr_ahead--;
+      continue;
+    }
+
+    for (int i = 0; i < nr_slots; i++) {
+      pfds[i].fd = slots[i].commit ? slots[i].fd : -1;
+      pfds[i].events = POLLIN;
+      pfds[i].revents = 0;
+    }
+
+    if (poll(pfds, nr_slots, -1) < 0) {
+      if (errno == EINTR)
+	continue;
+
+      die("poll() failed\n");
+    }
+
+    for (int i = 0; i < nr_slots; i++) {
+      if (slots[i].commit && (pfds[i].revents & (POLLIN | POLLHUP)))
+	load_progress(&slots[i]);
+    }
   }
 
-  close(0);
-  dup(pipefds[0]);
-  close(pipefds[1]);
-  if (execlp("xclip", "xclip", "-i", "-selection", board, NULL))
-    die("execlp() failed\n");
+  fflush(stdout);
+  return nr_hits ? 0 : 1;
 }
 
-static string get_jira_ticket(struct commit_cached *c) {
-  regex ticket_regex("(\\w+-\\d+)");
-  smatch match;
-  string msg = string(c->text);
+/*
+ * session: the place in the history, the saved place, the range, the last
+ * search and the working set (commits in the cache) are saved to the git
+ * directory when glg quits. the next session with the same arguments reopens
+ * there and prefetches the working set.
+ */
+#define SESSION_FILE "glg-session"
+#define SESSION_MAGIC "glg-session 1"
+#define SESSION_WORKING_SET_MAX 64
+/* saved commits moved by new commits are looked for this far */
+#define SESSION_SEARCH_SLACK 4096
+#define SESSION_ARGS_SIZE 4096
+
+struct session_commit {
+  long log_idx;
+  char commit_id[41];
+  int head_line;
+};
+
+static bool no_session;
+
+static struct {
+  struct session_commit current, orig, range_begin, range_end;
+  vector<struct session_commit> working_set;
 
-  if (regex_search(msg, match, ticket_regex)) {
-    return match[0];
-  }
+  bool has_search;
+  search_type type;
+  int global, direction;
+  unsigned int filter;
+  match_type mtype;
+  char query[QUERY_SIZE + 1];
 
-  return "";
+  long max_idx;
+} session;
+
+/* in_entire_history(): false for commits of file histories */
+static bool in_entire_history(struct commit *c)
+{
+  return c && 0 <= c->log_idx && c->log_idx < nr_read_commits
+    && commit_at(c->log_idx) == c;
 }
 
-static int yank(char cmd)
+static void session_put_commit(FILE *f, const char *key, struct commit *c,
+			       int head_line)
 {
-  if (clipboard_pid)
-    kill(clipboard_pid, SIGKILL);
+  /* a detached root isn't saved */
+  if (!in_entire_history(c))
+    return;
 
-  char yank_target;
-  move(row, 0);
-  printw("yank what? c (commit ID), j (jira ticket if exists), e (entire with editor) :");
-  refresh();
+  fprintf(f, "%s %d %s %d\n", key, c->log_idx, c->commit_id, head_line);
+}
 
-  int ret = read(tty_fd, &yank_target, 1);
-  if (ret != 1)
-    die("read() failed\n");
+static void session_save(void)
+{
+  if (file_history_path) {
+    save_chain(&file_histories[file_history_path]);
+    file_history_path = NULL;
+    restore_chain(&entire_history);
+  }
 
-  char *copy_buf;
-  int copy_buf_len;
+  if (!current)
+    return;
 
-  switch (yank_target) {
-  case 'c':
-    copy_buf = strdup(current->commit_id);
-    copy_buf_len = 41;
-    break;
-  case 'e':
-    copy_buf = copy_with_editor(current, &copy_buf_len);
-    break;
-  case 'j':
-    {
-      string ticket = get_jira_ticket(get_cached(current));
-      if (ticket.size() == 0) {
-	bmprintf("this commit doesn't have a jira ticket number\n");
-	return 1;
-      }
-      copy_buf = strdup(ticket.c_str());
-      copy_buf_len = ticket.size() + 1;
-    }
-    break;
-  default:
-    bmprintf("unknown yank target: %c\n", yank_target);
-    return 1;
+  char *path = git_path(SESSION_FILE);
+  if (!path)
+    return;
+
+  FILE *f = fopen(path, "w");
+  free(path);
+  if (!f)
+    return;
+
+  char args[SESSION_ARGS_SIZE];
+  git_args_signature(args, sizeof(args));
+  fprintf(f, SESSION_MAGIC "\nargs %s\n", args);
+
+  session_put_commit(f, "current", current, current->head_line);
+  session_put_commit(f, "orig", orig_place.commit, orig_place.head_line);
+  session_put_commit(f, "range_begin", range_begin, 0);
+  session_put_commit(f, "range_end", range_end, 0);
+
+  if (query_used)
+    fprintf(f, "search %d %d %d %u %d %s\n",
+	    (int)current_search_type, current_global, current_direction,
+	    match_filter, (int)current_match_type, query);
+
+  /* commits in the cache nearest to current */
+  vector<struct commit *> working_set;
+  for (struct commit *p = head; p; p = p->prev) {
+    if (p != current && p->cached.state == commit_cached_state::FILLED)
+      working_set.push_back(p);
   }
 
-  yank_with_xclip(copy_buf, copy_buf_len, "CLIPBOARD");
-  yank_with_xclip(copy_buf, copy_buf_len, "PRIMARY");
+  int idx = current->log_idx;
+  sort(working_set.begin(), working_set.end(),
+       [idx](struct commit *a, struct commit *b) {
+	 return abs(a->log_idx - idx) < abs(b->log_idx - idx);
+       });
 
-  free(copy_buf);
+  for (size_t i = 0;
+       i < working_set.size() && i < SESSION_WORKING_SET_MAX; i++)
+    session_put_commit(f, "work", working_set[i], 0);
 
-  return 1;
+  fclose(f);
 }
 
-static int help(char cmd)
+static bool session_parse_commit(const char *val, struct session_commit *sc)
 {
-  state = main_loop_state::HELP;
-  return 1;
+  if (sscanf(val, "%ld %40s %d", &sc->log_idx, sc->commit_id,
+	     &sc->head_line) != 3)
+    return false;
+
+  session.max_idx = max(session.max_idx, sc->log_idx);
+  return true;
 }
 
-struct key_cmd {
-  char key;
-  int (*op)(char);
-};
+/* session_load(): false if no session is saved for the arguments */
+static bool session_load(void)
+{
+  char *path = git_path(SESSION_FILE);
+  if (!path)
+    return false;
 
-static struct key_cmd valid_ops[] = {
-#define cmd(cmd, func, desc) { cmd, func },
-#include "default_cmd.def"
-#undef cmd
-  { '\0', NULL },
-};
+  FILE *f = fopen(path, "r");
+  free(path);
+  if (!f)
+    return false;
 
-static int search_filter_modified_line(char cmd)
-{
-  match_filter = match_filter_modified;
-  current_match_type = match_type::MODIFIED;
+  char line[SESSION_ARGS_SIZE + 64], args[SESSION_ARGS_SIZE];
+  bool valid = false;
 
-  if (state == main_loop_state::INPUT_SEARCH_FILTER2) {
-    state = main_loop_state::INPUT_SEARCH_DIRECTION;
-    return search(1, 1);
-  }
+  git_args_signature(args, sizeof(args));
 
-  state = main_loop_state::INPUT_SEARCH_DIRECTION;
+  while (fgets(line, sizeof(line), f)) {
+    line[strcspn(line, "\n")] = '\0';
 
-  bmprintf("type: %s, input search direction (/, ?, \\, !):",
-	   current_match_type_str());
+    if (!valid) {
+      /* the first two lines must be the magic and the same arguments */
+      if (strcmp(line, SESSION_MAGIC))
+	break;
 
-  return 1;
-}
+      if (!fgets(line, sizeof(line), f))
+	break;
+      line[strcspn(line, "\n")] = '\0';
 
-static int search_filter_at_line(char cmd)
-{
-  match_filter = match_filter_at;
-  current_match_type = match_type::AT;
+      if (strncmp(line, "args ", 5) || strcmp(line + 5, args))
+	break;
 
-  if (state == main_loop_state::INPUT_SEARCH_FILTER2) {
-    state = main_loop_state::INPUT_SEARCH_DIRECTION;
-    return search(1, 1);
-  }
+      valid = true;
+      continue;
+    }
 
-  state = main_loop_state::INPUT_SEARCH_DIRECTION;
+    char *val = strchr(line, ' ');
+    if (!val)
+      continue;
+    *val++ = '\0';
+
+    struct session_commit sc;
+    memset(&sc, 0, sizeof(sc));
+
+    if (!strcmp(line, "current"))
+      session_parse_commit(val, &session.current);
+    else if (!strcmp(line, "orig"))
+      session_parse_commit(val, &session.orig);
+    else if (!strcmp(line, "range_begin"))
+      session_parse_commit(val, &session.range_begin);
+    else if (!strcmp(line, "range_end"))
+      session_parse_commit(val, &session.range_end);
+    else if (!strcmp(line, "work")) {
+      if (session_parse_commit(val, &sc))
+	session.working_set.push_back(sc);
+    } else if (!strcmp(line, "search")) {
+      int type, mtype, n;
+
+      if (sscanf(val, "%d %d %d %u %d %n", &type, &session.global,
+		 &session.direction, &session.filter, &mtype, &n) != 5)
+	continue;
 
-  bmprintf("type: %s, input search direction (/, ?, \\, !):",
-	   current_match_type_str());
+      session.type = static_cast<search_type>(type);
+      session.mtype = static_cast<match_type>(mtype);
+      snprintf(session.query, sizeof(session.query), "%s", val + n);
+      session.has_search = !!session.query[0];
+    }
+  }
 
-  return 1;
+  fclose(f);
+  return valid;
 }
 
-static int search_filter_commit_message(char cmd)
+/* session_find(): the saved commit in the history, NULL if it is gone */
+static struct commit *session_find(struct session_commit *sc)
 {
-  match_filter = match_filter_commit_message;
-  current_match_type = match_type::COMMIT_MESSAGE;
+  if (!sc->commit_id[0])
+    return NULL;
 
-  if (state == main_loop_state::INPUT_SEARCH_FILTER2) {
-    state = main_loop_state::INPUT_SEARCH_DIRECTION;
-    return search(1, 1);
+  if (sc->log_idx < nr_read_commits) {
+    struct commit *c = commit_at(sc->log_idx);
+    if (!strcmp(c->commit_id, sc->commit_id))
+      return c;
   }
 
-  state = main_loop_state::INPUT_SEARCH_DIRECTION;
-
-  bmprintf("type: %s(not implemented yet!), input search direction (/, ?, \\, !):",
-	   current_match_type_str());
+  /* the history is changed since the session is saved */
+  for (struct commit *p = head; p; p = p->prev) {
+    if (!strcmp(p->commit_id, sc->commit_id))
+      return p;
+  }
 
-  return 1;
+  return NULL;
 }
 
-static int search_filter_file_line(char cmd)
+static void session_restore_search(void)
 {
-  match_filter = match_filter_file;
-  current_match_type = match_type::FILE;
+  snprintf(query, sizeof(query), "%s", session.query);
+  query_used = strlen(query);
 
-  if (state == main_loop_state::INPUT_SEARCH_FILTER2) {
-    state = main_loop_state::INPUT_SEARCH_DIRECTION;
-    return search(1, 1);
-  }
+  current_search_type = session.type;
+  current_global = session.global;
+  current_direction = session.direction;
+  match_filter = session.filter;
+  current_match_type = session.mtype;
 
-  state = main_loop_state::INPUT_SEARCH_DIRECTION;
+  if (current_search_type == search_type::REGEX) {
+    re_compiled = static_cast<regex_t *>(xalloc(sizeof(regex_t)));
+    regcomp(re_compiled, query, REG_ICASE);
+  } else
+    tokenize_query();
 
-  bmprintf("type: %s, input search direction (/, ?, \\, !):",
-	   current_match_type_str());
+  state = main_loop_state::SEARCHING_QUERY;
 
-  return 1;
+  if (current_global && current_search_type == search_type::REGEX)
+    match_list_start();
 }
 
-static int search_filter_cancel(char cmd)
+static void session_restore(void)
 {
-  match_filter = match_filter_default;
-  current_match_type = match_type::DEFAULT;
-  state = main_loop_state::DEFAULT;
-
-  return 1;
-}
+  struct commit *c;
 
-static int search_filter_invalid(char cmd)
-{
-  bmprintf("invalid search type: %c\n", cmd);
-  match_filter = match_filter_default;
-  current_match_type = match_type::DEFAULT;
-  state = main_loop_state::DEFAULT;
+  if ((c = session_find(&session.current))) {
+    current = c;
+    current->head_line = session.current.head_line;
+  }
 
-  return 1;
-}
+  if ((c = session_find(&session.orig))) {
+    orig_place.commit = c;
+    orig_place.head_line = session.orig.head_line;
+  }
 
-static struct key_cmd search_filter_ops[] = {
-  { 'm', search_filter_modified_line },
-  { 'a', search_filter_at_line },
-  { 'l', search_filter_commit_message },
-  { 'f', search_filter_file_line },
+  range_begin = session_find(&session.range_begin);
+  range_end = session_find(&session.range_end);
+  if (range_begin && range_end)
+    range_state = range_state::SPECIFIED;
+  else if (range_begin)
+    range_state = range_state::BEGIN_SPECIFIED;
+  else if (range_end)
+    range_state = range_state::END_SPECIFIED;
+
+  if (session.has_search)
+    session_restore_search();
+
+  struct commit **list = static_cast<struct commit **>(xalloc((session.working_set.size() + 1) * sizeof(struct commit *)));
+  int nr = 0;
+  for (auto &sc : session.working_set) {
+    if ((c = session_find(&sc)))
+      list[nr++] = c;
+  }
 
-  { 0x1b, search_filter_cancel },
+  if (nr)
+    prefetch_start_list(list, nr, "working set");
+  else {
+    free(list);
+    bmprintf("session restored");
+  }
 
-  { '\0', NULL },
-};
+  session.working_set.clear();
+}
 
-static int search_direction_cancel(char cmd)
+/* session_in_place(): true if current is saved at the same position */
+static bool session_in_place(void)
 {
-  match_filter = match_filter_default;
-  current_match_type = match_type::DEFAULT;
-  state = main_loop_state::DEFAULT;
+  struct session_commit *sc = &session.current;
 
-  return 1;
+  return sc->log_idx < nr_read_commits
+    && !strcmp(commit_at(sc->log_idx)->commit_id, sc->commit_id);
 }
 
-static int search_direction_invalid(char cmd)
+static int resume_step(void)
 {
-  bmprintf("invalid direction specifier: %c\n", cmd);
-  state = main_loop_state::DEFAULT;
-  return 1;
+  for (int i = 0; i < FILL_HISTORY_BATCH; i++) {
+    if (read_end || session.max_idx + SESSION_SEARCH_SLACK < nr_read_commits)
+      return 1;
+
+    if (nr_read_commits == session.max_idx + 1 && session_in_place())
+      return 1;
+
+    read_commit();
+  }
+
+  bmprintf("restoring session... (%d commits)", nr_read_commits);
+  return 0;
 }
 
-static struct key_cmd search_direction_ops[] = {
-  { '/', search_global_forward },
-  { '?', search_global_backward },
-  { '\\', search_local_forward },
-  { '!', search_local_backward },
+static void resume_compl(bool stopped)
+{
+  if (stopped) {
+    bmprintf("restoring session stopped");
+    return;
+  }
 
-  { 0x1b, search_direction_cancel },
+  session_restore();
+}
 
-  { '\0', NULL },
+static struct job resume_job = {
+  "restoring session", job_prio::SCREEN, true, resume_step, resume_compl,
 };
 
-static int (*ops_array[256])(char);
-static int (*search_filter_ops_array[256])(char);
-static int (*search_direction_ops_array[256])(char);
-
-static void exit_handler(void)
+static void session_resume(void)
 {
-  addch('\n');
+  if (no_session || !session_load())
+    return;
 
-  if (clipboard_pid)
-    kill(clipboard_pid, SIGKILL);
+  if (session.max_idx < nr_read_commits) {
+    session_restore();
+    return;
+  }
 
-  endwin();
+  /* the IDs are read until the saved positions in the main loop */
+  job_start(&resume_job);
 
-  fprintf(stderr, dying_msg);
+  bmprintf("restoring session...");
 }
 
 int main(int argc, char **argv)
 {
-  int i, sigfd;
+  int i, sigfd, task_fd;
   char cmd;
-  struct pollfd pfds[2];
+  struct pollfd pfds[8 + NR_LOADS];
+  int nr_pfds;
   int show_merge_commits;	// TODO: not implemented yet
 
+  main_thread = pthread_self();
+  clock_gettime(CLOCK_MONOTONIC, &startup_at);
+
+  /* arguments after "--" are pathspecs */
+  int nr_args = argc;
+  for (i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "--")) {
+      nr_args = i;
+      break;
+    }
+  }
+
+  for (i = nr_args + 1; i < argc; i++)
+    git_add_pathspec(argv[i]);
+
   while (1) {
     static struct option long_options[] =
     {
       {"show-merge-commits", no_argument, &show_merge_commits, 0},
       {"debug-file-path", required_argument, 0, 'd'},
       {"help", no_argument, 0, 'h'},
+      /* passed to git log */
+      {"all", no_argument, 0, 'a'},
+      {"first-parent", no_argument, 0, 'f'},
+      {"since", required_argument, 0, 'S'},
+      {"until", required_argument, 0, 'U'},
+      {"ticket-pattern", required_argument, 0, 'P'},
+      /* batch search */
+      {"grep", required_argument, 0, 'G'},
+      {"filter", required_argument, 0, 'L'},
+      {"range", required_argument, 0, 'r'},
+      {"json", no_argument, 0, 'j'},
+      {"no-session", no_argument, 0, 'N'},
+      {"bench-startup", no_argument, 0, 'B'},
       {0, 0, 0, 0}
     };
     int option_index = 0;
-    int c = getopt_long(argc, argv, "d:h", long_options, &option_index);
+    int c = getopt_long(nr_args, argv, "d:h", long_options, &option_index);
 
     if (c == -1)
       break;
 
     switch (c) {
+    case 0:
+      break;
     case 'd':
       debug_file_path = optarg;
       break;
+    case 'a':
+    case 'f':
+      git_add_log_option(argv[optind - 1]);
+      break;
+    case 'S':
+    case 'U': {
+      char *opt = static_cast<char *>(xalloc(strlen(optarg) + 16));
+      sprintf(opt, "--%s=%s", long_options[option_index].name, optarg);
+      git_add_log_option(opt);
+      break;
+    }
+    case 'P':
+      ticket_pattern = optarg;
+      break;
+    case 'G':
+      batch_grep = optarg;
+      break;
+    case 'L':
+      if (!set_batch_filter(optarg)) {
+	printf("unknown filter: %s\n", optarg);
+	exit(1);
+      }
+      break;
+    case 'r':
+      git_add_revision(optarg);
+      break;
+    case 'j':
+      batch_json = true;
+      break;
+    case 'N':
+      no_session = true;
+      break;
+    case 'B':
+      bench_startup = true;
+      break;
     case 'h':
-      printf("TODO: help\n");
+      printf("usage: glg [options] [<revision range>...] [-- <path>...]\n"
+	     "  --all, --first-parent, --since=<date>, --until=<date>\n"
+	     "                 passed to git log\n"
+	     "  --ticket-pattern=<regex>\n"
+	     "                 extended regex of ticket numbers (default: %s)\n"
+	     "  --grep=<regex> [--filter=<filter>] [--range=<range>] [--json]\n"
+	     "                 print matched lines without the terminal\n"
+	     "                 (filter: default, modified, at, commit, file)\n"
+	     "  --no-session   start at HEAD without restoring the last session\n"
+	     "  --bench-startup\n"
+	     "                 print the time until the first commit is shown\n"
+	     "  -d, --debug-file-path=<path>\n", DEFAULT_TICKET_PATTERN);
       exit(1);
       break;
     default:
@@ -2281,6 +6699,14 @@ int main(int argc, char **argv)
     }
   }
 
+  for (i = optind; i < nr_args; i++)
+    git_add_revision(argv[i]);
+
+  if (!ticket_set_pattern(ticket_pattern)) {
+    printf("invalid ticket pattern: %s\n", ticket_pattern);
+    exit(1);
+  }
+
   if (debug_file_path) {
     unlink(debug_file_path);
     int debug_fd = open(debug_file_path, O_WRONLY | O_CREAT, S_IRUSR | S_IWUSR);
@@ -2292,14 +6718,46 @@ int main(int argc, char **argv)
       die("failed fdopen() for debug_file");
   }
 
+  page_size = sysconf(_SC_PAGESIZE);
+  init_alloc_lim();
+
   launch_git_log(0);
+  log_buf = alloc_log_buf();
+
+  if (batch_grep) {
+    /* compiled like a regex search from the terminal */
+    re_compiled = static_cast<regex_t *>(xalloc(sizeof(regex_t)));
+    if (regcomp(re_compiled, batch_grep, REG_ICASE)) {
+      printf("invalid regex: %s\n", batch_grep);
+      exit(2);
+    }
+
+    exit(batch_search());
+  }
 
   bottom_message = static_cast<char *>(xalloc(bottom_message_size));
-  match_array = static_cast<regmatch_t *>(xalloc(match_array_size * sizeof(regmatch_t)));
 
+  /* called after exit_handler() ends the terminal */
+  if (bench_startup)
+    atexit(print_startup_time);
   atexit(exit_handler);
 
   sigfd = init_signalfd();
+
+  /*
+   * the text of the first commit is loaded while the rest is initialized,
+   * the first paint waits only for the slowest of them
+   */
+  read_commit();
+  if (current)
+    load_start(&screen_load, current, true, load_compl_fill);
+
+  init_history_size();
+  init_watch();
+  pressure_fd = watch_pressure();
+
+  /* workers inherit the blocked signals */
+  task_fd = workers_start();
   init_tty();
 
   memset(pfds, 0, sizeof(pfds));
@@ -2310,9 +6768,9 @@ int main(int argc, char **argv)
   pfds[1].fd = tty_fd;
   pfds[1].events = POLLIN;
 
-  read_commit();
+  match_filter = LINE_CLASS_ALL;
 
-  match_filter = match_filter_default;
+  session_resume();
 
   update_terminal();
 
@@ -2339,10 +6797,59 @@ int main(int argc, char **argv)
   while (running) {
     int ret = 0, pret;
 
-    pret = poll(pfds, 2, state_long_run == long_run::RUNNING ? 0 : -1);
+    nr_pfds = 2;
+    nr_pfds += history_count_pollfd(&pfds[nr_pfds]);
+    nr_pfds += ticket_stream_pollfd(&pfds[nr_pfds]);
+    nr_pfds += watch_pollfd(&pfds[nr_pfds]);
+    nr_pfds += pressure_pollfd(&pfds[nr_pfds]);
+    nr_pfds += msg_grep_pollfd(&pfds[nr_pfds]);
+
+    /* finished tasks of the workers */
+    pfds[nr_pfds].fd = task_fd;
+    pfds[nr_pfds].events = POLLIN;
+    pfds[nr_pfds].revents = 0;
+    nr_pfds++;
+
+    nr_pfds += loads_pollfds(&pfds[nr_pfds]);
+
+    /* keys are read after foreground jobs */
+    pfds[1].events = jobs_foreground() ? 0 : POLLIN;
+
+    int timeout = refs_changed && history_updatable() ?
+      refs_settle_timeout() : -1;
+    int loads = loads_timeout();
+    if (0 <= loads && (timeout < 0 || loads < timeout))
+      timeout = loads;
+    int pressure = pressure_timeout();
+    if (0 <= pressure && (timeout < 0 || pressure < timeout))
+      timeout = pressure;
+    if (jobs_runnable())
+      timeout = 0;
+
+    pret = poll(pfds, nr_pfds, timeout);
     if (pret < 0)
       die("poll() failed");
 
+    if (refs_changed && history_updatable() && !refs_settle_timeout()) {
+      history_update();
+      update_terminal();
+    }
+
+    if (history_count_handle_pollfd(&pfds[2]))
+      update_terminal();
+
+    ticket_stream_handle_pollfd(&pfds[3]);
+    watch_handle_pollfd(&pfds[4]);
+
+    pressure_handle_pollfd(&pfds[5]);
+    msg_grep_handle_pollfd(&pfds[6]);
+
+    if (pfds[7].revents & POLLIN)
+      tasks_complete();
+
+    if (loads_handle_pollfds(&pfds[8]))
+      update_terminal();
+
     if (pfds[0].revents & POLLIN) {
       struct signalfd_siginfo siginfo;
       int rbytes;
@@ -2354,34 +6861,10 @@ int main(int argc, char **argv)
       signal_handler(siginfo.ssi_signo);
     }
 
-    if (state_long_run != long_run::DEFAULT) {
-      assert(long_run_command);
-      assert(long_run_command_compl);
-
-      switch (state_long_run) {
-      case long_run::RUNNING:
-	if (long_run_command()) {
-	  long_run_command_compl(false);
-	  goto long_run_end;
-	}
-
-	continue;
-      case long_run::STOPPED:
-	long_run_command_compl(true);
-
-      long_run_end:
-	state_long_run = long_run::DEFAULT;
-	long_run_command = NULL;
-	long_run_command_compl = NULL;
-
-	ret = 1;
-
-	break;
-      default:
-	die("unknown state_long_run: %d", state_long_run);
-	break;
-      }
-    }
+    if (jobs_run())
+      ret = 1;
+    else if (jobs_foreground())
+      continue;
 
     if (pfds[1].revents & POLLIN) {
       ret = read(tty_fd, &cmd, 1);
@@ -2406,9 +6889,21 @@ int main(int argc, char **argv)
 	ret = input_query(cmd);
 	break;
 
+      case main_loop_state::INPUT_COMMIT_FILTER:
+	ret = input_commit_filter(cmd);
+	break;
+
       case main_loop_state::SEARCHING_QUERY:
       case main_loop_state::DEFAULT:
 	ret = ops_array[(int)cmd](cmd);
+	if (!isdigit(cmd))
+	  count_prefix = 0;
+
+	if (load_canceled && cmd != 0x1b) {
+	  /* retry loading */
+	  load_canceled = NULL;
+	  ret = 1;
+	}
 	break;
 
       case main_loop_state::INPUT_SEARCH_DIRECTION:
@@ -2472,19 +6967,15 @@ int main(int argc, char **argv)
 	break;
 
       case main_loop_state::SHOW_CHANGED_FILES:
-	if (cmd == 'q') {
-	  state = main_loop_state::DEFAULT;
-	  ret = 1;
-	}
+	ret = changed_files_input(cmd);
 	break;
 
-      case main_loop_state::HELP:
-	if (cmd == 'q') {
-	  state = main_loop_state::DEFAULT;
-	  ret = 1;
-	} else
-	  ret = 0;
+      case main_loop_state::SHOW_COMMIT_LIST:
+	ret = commit_list_input(cmd);
+	break;
 
+      case main_loop_state::HELP:
+	ret = help_input(cmd);
 	break;
       default:
 	die("invalid state: %d\n", state);
@@ -2496,5 +6987,11 @@ int main(int argc, char **argv)
       update_terminal();
   }
 
+  /* the workers can be scanning texts which are freed at exit */
+  workers_stop();
+
+  if (!bench_startup)
+    session_save();
+
   return 0;
 }
@@ -0,0 +1,144 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+
+#include <string>
+
+#include "util.hh"
+#include "pressure.hh"
+
+using namespace std;
+
+#define CGROUP_ROOT "/sys/fs/cgroup"
+
+/* a stall of 150ms in a 2s window, the smallest window of unprivileged users */
+#define PRESSURE_TRIGGER "some 150000 2000000"
+
+/* cgroup_path(): the cgroup v2 path of glg, e.g. "/user.slice/..." */
+static bool cgroup_path(string *path)
+{
+  FILE *f = fopen("/proc/self/cgroup", "r");
+  if (!f)
+    return false;
+
+  char line[PATH_MAX + 16];
+  bool found = false;
+
+  /* the unified hierarchy is "0::<path>" */
+  while (fgets(line, sizeof(line), f)) {
+    if (strncmp(line, "0::", 3))
+      continue;
+
+    line[strcspn(line, "\n")] = '\0';
+    *path = line + 3;
+    found = true;
+    break;
+  }
+
+  fclose(f);
+  return found;
+}
+
+/* read_size(): a number in the file, false for "max" or errors */
+static bool read_size(const char *file, size_t *size)
+{
+  FILE *f = fopen(file, "r");
+  if (!f)
+    return false;
+
+  unsigned long long val;
+  bool ret = fscanf(f, "%llu", &val) == 1;
+  fclose(f);
+
+  if (ret)
+    *size = val;
+
+  return ret;
+}
+
+static size_t cgroup_limit(void)
+{
+  string path;
+  if (!cgroup_path(&path))
+    return 0;
+
+  size_t limit = 0;
+
+  /* limits of the ancestors apply too */
+  while (1) {
+    size_t max;
+    if (read_size((CGROUP_ROOT + path + "/memory.max").c_str(), &max)
+	&& (!limit || max < limit))
+      limit = max;
+
+    size_t slash = path.rfind('/');
+    if (slash == string::npos || path == "/")
+      break;
+
+    path.resize(slash ? slash : 1);
+  }
+
+  return limit;
+}
+
+static size_t mem_available(void)
+{
+  FILE *f = fopen("/proc/meminfo", "r");
+  if (!f)
+    return 0;
+
+  char line[256];
+  size_t ret = 0;
+
+  while (fgets(line, sizeof(line), f)) {
+    unsigned long long kb;
+
+    if (sscanf(line, "MemAvailable: %llu kB", &kb) == 1) {
+      ret = kb << 10;
+      break;
+    }
+  }
+
+  fclose(f);
+  return ret;
+}
+
+size_t mem_limit(void)
+{
+  size_t cgroup = cgroup_limit(), available = mem_available();
+
+  if (!cgroup || !available)
+    return cgroup ? cgroup : available;
+
+  return cgroup < available ? cgroup : available;
+}
+
+static int open_trigger(const char *file)
+{
+  int fd = open(file, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+  if (fd < 0)
+    return -1;
+
+  /* the trigger includes '\0' */
+  if (write(fd, PRESSURE_TRIGGER, strlen(PRESSURE_TRIGGER) + 1) < 0) {
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+int watch_pressure(void)
+{
+  string path;
+  if (cgroup_path(&path)) {
+    int fd = open_trigger((CGROUP_ROOT + path + "/memory.pressure").c_str());
+    if (0 <= fd)
+      return fd;
+  }
+
+  return open_trigger("/proc/pressure/memory");
+}
@@ -0,0 +1,38 @@
+/*
+ * glg - a specialized pager for git log
+ *
+ * Copyright (C) 2012 - 2016 Hitoshi Mitake <mitake.hitoshi@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+/*
+ * memory of the system and the cgroup of glg. the cgroup v2 limit is the
+ * smallest memory.max of the cgroup and its ancestors.
+ */
+
+/* mem_limit(): min of the cgroup limit and MemAvailable, 0 if unknown */
+size_t mem_limit(void);
+
+/*
+ * watch_pressure(): return an fd for poll() with POLLPRI, which is notified
+ * when tasks stall on memory. the cgroup's memory.pressure is preferred to
+ * /proc/pressure/memory. -1 if PSI isn't available.
+ */
+int watch_pressure(void);
@@ -0,0 +1,334 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+#include <algorithm>
+
+#include "util.hh"
+#include "sched.hh"
+
+using namespace std;
+
+#define MAX_JOBS 16
+
+static struct job *jobs[MAX_JOBS];
+static int nr_jobs;
+
+/* slices given to a job per iteration of the main loop, by priority */
+static const int job_slices[] = { 4, 2, 1, };
+
+static void job_remove(struct job *j)
+{
+  for (int i = 0; i < nr_jobs; i++) {
+    if (jobs[i] != j)
+      continue;
+
+    memmove(&jobs[i], &jobs[i + 1], (nr_jobs - i - 1) * sizeof(jobs[0]));
+    nr_jobs--;
+    break;
+  }
+
+  j->running = false;
+}
+
+void job_cancel(struct job *j)
+{
+  if (!j->running)
+    return;
+
+  job_remove(j);
+  j->finish(true);
+}
+
+void job_start(struct job *j)
+{
+  job_cancel(j);
+
+  /* finish() of a canceled job can start or stop others */
+  for (int i = 0; j->foreground && i < nr_jobs; i++) {
+    if (jobs[i]->foreground) {
+      job_cancel(jobs[i]);
+      i = -1;
+    }
+  }
+
+  assert(nr_jobs < MAX_JOBS);
+  jobs[nr_jobs++] = j;
+
+  j->running = true;
+  j->stopped = false;
+  j->blocked = false;
+}
+
+void job_stop(struct job *j)
+{
+  if (j->running)
+    j->stopped = true;
+}
+
+bool job_running(struct job *j)
+{
+  return j->running;
+}
+
+bool jobs_foreground(void)
+{
+  for (int i = 0; i < nr_jobs; i++) {
+    if (jobs[i]->foreground)
+      return true;
+  }
+
+  return false;
+}
+
+void jobs_stop_foreground(void)
+{
+  for (int i = 0; i < nr_jobs; i++) {
+    if (jobs[i]->foreground)
+      job_stop(jobs[i]);
+  }
+}
+
+bool jobs_runnable(void)
+{
+  for (int i = 0; i < nr_jobs; i++) {
+    if (jobs[i]->stopped || !jobs[i]->blocked)
+      return true;
+  }
+
+  return false;
+}
+
+bool jobs_run(void)
+{
+  /* finish() can start and stop jobs, they are run from the next call */
+  struct job *snapshot[MAX_JOBS];
+  int nr_snapshot = nr_jobs;
+  bool ended = false;
+
+  memcpy(snapshot, jobs, nr_jobs * sizeof(jobs[0]));
+  stable_sort(snapshot, snapshot + nr_snapshot,
+	      [](struct job *a, struct job *b) { return a->prio < b->prio; });
+
+  for (int i = 0; i < nr_snapshot; i++) {
+    struct job *j = snapshot[i];
+
+    for (int s = 0; s < job_slices[(int)j->prio]; s++) {
+      if (!j->running || j->stopped)
+	break;
+
+      j->blocked = false;
+      if (j->step()) {
+	job_remove(j);
+	j->finish(false);
+	ended = true;
+	break;
+      }
+
+      if (j->blocked)
+	break;
+    }
+
+    if (j->running && j->stopped) {
+      job_remove(j);
+      j->finish(true);
+      ended = true;
+    }
+  }
+
+  return ended;
+}
+
+/*
+ * worker threads: tasks are queued in FIFO order, finished ones are passed
+ * back to the main thread through task_efd
+ */
+#define WORKERS_MAX 8
+
+enum {
+  TASK_IDLE,
+  TASK_QUEUED,
+  TASK_RUNNING,
+  TASK_FINISHED,
+};
+
+static pthread_mutex_t tasks_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t tasks_queued = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t tasks_finished = PTHREAD_COND_INITIALIZER;
+
+static struct task *queue_head, *queue_tail;
+static struct task *finished_head, *finished_tail;
+
+static int task_efd = -1;
+
+/* workers_stop() makes the workers exit, nr_workers counts the running ones */
+static bool workers_stopping;
+static int nr_workers;
+
+static void task_append(struct task **head, struct task **tail,
+			struct task *t)
+{
+  t->next = NULL;
+  if (*tail)
+    (*tail)->next = t;
+  else
+    *head = t;
+  *tail = t;
+}
+
+static void task_unlink(struct task **head, struct task **tail,
+			struct task *t)
+{
+  struct task *prev = NULL;
+
+  for (struct task *p = *head; p; prev = p, p = p->next) {
+    if (p != t)
+      continue;
+
+    if (prev)
+      prev->next = p->next;
+    else
+      *head = p->next;
+    if (*tail == p)
+      *tail = prev;
+    break;
+  }
+
+  t->next = NULL;
+}
+
+static void *worker(void *arg)
+{
+  pthread_mutex_lock(&tasks_lock);
+
+  while (1) {
+    while (!queue_head && !workers_stopping)
+      pthread_cond_wait(&tasks_queued, &tasks_lock);
+    if (workers_stopping)
+      break;
+
+    struct task *t = queue_head;
+    task_unlink(&queue_head, &queue_tail, t);
+    t->state = TASK_RUNNING;
+    pthread_mutex_unlock(&tasks_lock);
+
+    t->run(t);
+
+    pthread_mutex_lock(&tasks_lock);
+    t->state = TASK_FINISHED;
+    task_append(&finished_head, &finished_tail, t);
+    pthread_cond_broadcast(&tasks_finished);
+
+    uint64_t one = 1;
+    if (write(task_efd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+      die("write() to eventfd failed\n");
+  }
+
+  nr_workers--;
+  pthread_cond_broadcast(&tasks_finished);
+  pthread_mutex_unlock(&tasks_lock);
+
+  return NULL;
+}
+
+int workers_start(void)
+{
+  task_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (task_efd < 0)
+    die("eventfd() failed\n");
+
+  long nr = sysconf(_SC_NPROCESSORS_ONLN);
+  nr = max(1L, min(nr, (long)WORKERS_MAX));
+
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+  for (long i = 0; i < nr; i++) {
+    pthread_t thread;
+    if (pthread_create(&thread, &attr, worker, NULL))
+      die("pthread_create() failed\n");
+
+    pthread_mutex_lock(&tasks_lock);
+    nr_workers++;
+    pthread_mutex_unlock(&tasks_lock);
+  }
+
+  pthread_attr_destroy(&attr);
+
+  return task_efd;
+}
+
+void workers_stop(void)
+{
+  pthread_mutex_lock(&tasks_lock);
+
+  /* queued tasks aren't run, running ones are waited for */
+  while (queue_head) {
+    queue_head->state = TASK_IDLE;
+    task_unlink(&queue_head, &queue_tail, queue_head);
+  }
+
+  workers_stopping = true;
+  pthread_cond_broadcast(&tasks_queued);
+  while (nr_workers)
+    pthread_cond_wait(&tasks_finished, &tasks_lock);
+
+  pthread_mutex_unlock(&tasks_lock);
+}
+
+void task_submit(struct task *t)
+{
+  assert(task_efd != -1);
+
+  pthread_mutex_lock(&tasks_lock);
+  t->state = TASK_QUEUED;
+  task_append(&queue_head, &queue_tail, t);
+  pthread_cond_signal(&tasks_queued);
+  pthread_mutex_unlock(&tasks_lock);
+}
+
+void task_cancel(struct task *t)
+{
+  pthread_mutex_lock(&tasks_lock);
+
+  if (t->state == TASK_QUEUED)
+    task_unlink(&queue_head, &queue_tail, t);
+
+  while (t->state == TASK_RUNNING)
+    pthread_cond_wait(&tasks_finished, &tasks_lock);
+
+  if (t->state == TASK_FINISHED)
+    task_unlink(&finished_head, &finished_tail, t);
+
+  t->state = TASK_IDLE;
+  pthread_mutex_unlock(&tasks_lock);
+}
+
+void tasks_complete(void)
+{
+  uint64_t count;
+  if (read(task_efd, &count, sizeof(count)) < 0
+      && errno != EAGAIN && errno != EINTR)
+    die("read() from eventfd failed\n");
+
+  /* one by one, done() can submit or cancel tasks */
+  while (1) {
+    pthread_mutex_lock(&tasks_lock);
+    struct task *t = finished_head;
+    if (t) {
+      task_unlink(&finished_head, &finished_tail, t);
+      t->state = TASK_IDLE;
+    }
+    pthread_mutex_unlock(&tasks_lock);
+
+    if (!t)
+      break;
+
+    t->done(t);
+  }
+}
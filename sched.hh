@@ -0,0 +1,97 @@
+/*
+ * glg - a specialized pager for git log
+ *
+ * Copyright (C) 2012 - 2016 Hitoshi Mitake <mitake.hitoshi@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#pragma once
+
+/*
+ * jobs: long running work progressed in slices by the main loop. several
+ * jobs run at once, jobs with higher priority get more slices. work which
+ * doesn't touch the state of the main loop (e.g. scanning a pinned text) can
+ * be passed to worker threads as tasks.
+ */
+
+/* in the order of priority */
+enum class job_prio {
+  SCREEN,			/* moving the screen, e.g. visiting root */
+  SEARCH,
+  PREFETCH,
+  NR_PRIOS,
+};
+
+struct job {
+  const char *name;
+  job_prio prio;
+  /* foreground jobs move the screen, keys are read after they end */
+  bool foreground;
+
+  /* step(): a slice of the job. return 1 when it ends, 0 for continuing */
+  int (*step)(void);
+  /* finish(): called after the job ended or was stopped */
+  void (*finish)(bool stopped);
+
+  /*
+   * blocked: set by step() when it waits for a fd polled in the main loop,
+   * e.g. a git process loading a commit, or a task
+   */
+  bool blocked;
+
+  /* private to the scheduler */
+  bool running, stopped;
+};
+
+/*
+ * job_start(): a running foreground job is stopped by another one, starting
+ * a running job restarts it
+ */
+void job_start(struct job *j);
+/* job_stop(): finish() is called by jobs_run() */
+void job_stop(struct job *j);
+/* job_cancel(): stop j at once, finish() is called before returning */
+void job_cancel(struct job *j);
+bool job_running(struct job *j);
+
+bool jobs_foreground(void);
+void jobs_stop_foreground(void);
+/* jobs_runnable(): true if a job can progress without waiting for a fd */
+bool jobs_runnable(void);
+/* jobs_run(): give slices to jobs, true when a job ended */
+bool jobs_run(void);
+
+struct task {
+  /* run(): called in a worker thread */
+  void (*run)(struct task *t);
+  /* done(): called in the main thread by tasks_complete() after run() */
+  void (*done)(struct task *t);
+  void *arg;
+
+  /* private to the workers */
+  struct task *next;
+  int state;
+};
+
+/* workers_start(): return an eventfd readable when tasks are finished */
+int workers_start(void);
+/* workers_stop(): drop queued tasks, wait for running ones and the workers */
+void workers_stop(void);
+void task_submit(struct task *t);
+/* task_cancel(): dequeue or wait for t, done() isn't called for it */
+void task_cancel(struct task *t);
+/* tasks_complete(): call done() of finished tasks */
+void tasks_complete(void);
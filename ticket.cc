@@ -0,0 +1,125 @@
+#include <regex.h>
+#include <string.h>
+
+#include <string>
+#include <unordered_map>
+#include <algorithm>
+
+#include "ticket.hh"
+
+using namespace std;
+
+static regex_t ticket_re;
+static bool ticket_re_compiled;
+
+static unordered_map<string, vector<int>> ticket_index;
+/* approximate bytes used by ticket_index */
+static size_t index_usage;
+
+bool ticket_set_pattern(const char *pattern)
+{
+  if (ticket_re_compiled)
+    regfree(&ticket_re);
+
+  ticket_re_compiled = !regcomp(&ticket_re, pattern, REG_EXTENDED);
+  return ticket_re_compiled;
+}
+
+int ticket_match(const char *s, const char **begin)
+{
+  regmatch_t m;
+
+  if (!ticket_re_compiled || regexec(&ticket_re, s, 1, &m, 0))
+    return 0;
+
+  if (m.rm_so == m.rm_eo)
+    return 0;
+
+  *begin = s + m.rm_so;
+  return m.rm_eo - m.rm_so;
+}
+
+static void ticket_index_add(const char *ticket, int len, int log_idx)
+{
+  auto ins = ticket_index.emplace(string(ticket, len), vector<int>());
+  vector<int> &commits = ins.first->second;
+  size_t capacity = commits.capacity();
+
+  if (ins.second)
+    index_usage += sizeof(*ins.first) + len + 1;
+
+  /* commits are mostly added in the order of git log */
+  if (commits.empty() || commits.back() < log_idx)
+    commits.push_back(log_idx);
+  else {
+    auto it = lower_bound(commits.begin(), commits.end(), log_idx);
+    if (*it != log_idx)
+      commits.insert(it, log_idx);
+  }
+
+  index_usage += (commits.capacity() - capacity) * sizeof(int);
+}
+
+size_t ticket_index_usage(void)
+{
+  return index_usage;
+}
+
+void ticket_index_line(const char *line, int log_idx)
+{
+  const char *begin;
+  int len;
+
+  if (log_idx < 0)
+    return;
+
+  while ((len = ticket_match(line, &begin))) {
+    ticket_index_add(begin, len, log_idx);
+    line = begin + len;
+  }
+}
+
+const vector<int> *ticket_index_lookup(const char *ticket)
+{
+  auto it = ticket_index.find(ticket);
+  if (it == ticket_index.end())
+    return NULL;
+
+  return &it->second;
+}
+
+static string stream_line;
+static int stream_idx = -1;
+
+void ticket_index_clear(void)
+{
+  ticket_index.clear();
+  index_usage = 0;
+
+  stream_line.clear();
+  stream_idx = -1;
+}
+
+void ticket_stream_feed(const char *buf, size_t len)
+{
+  for (size_t i = 0; i < len; i++) {
+    char ch = buf[i];
+
+    if (ch != '\n' && ch != '\x1e') {
+      stream_line.push_back(ch);
+      continue;
+    }
+
+    ticket_index_line(stream_line.c_str(), stream_idx);
+    stream_line.clear();
+
+    if (ch == '\x1e')
+      stream_idx++;
+  }
+}
+
+void ticket_stream_end(void)
+{
+  ticket_index_line(stream_line.c_str(), stream_idx);
+  stream_line.clear();
+}
@@ -0,0 +1,59 @@
+/*
+ * glg - a specialized pager for git log
+ *
+ * Copyright (C) 2012 - 2016 Hitoshi Mitake <mitake.hitoshi@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+#include <vector>
+
+/*
+ * index from ticket references (e.g. JIRA-123) in commit messages to
+ * positions of the commits in git log (log_idx)
+ */
+
+#define DEFAULT_TICKET_PATTERN "[A-Z][A-Z0-9_]+-[0-9]+"
+
+bool ticket_set_pattern(const char *pattern);
+
+/*
+ * ticket_match(): find the first ticket in NUL terminated s.
+ * return its length and set *begin, or return 0.
+ */
+int ticket_match(const char *s, const char **begin);
+
+/* ticket_index_line(): add tickets in a NUL terminated message line */
+void ticket_index_line(const char *line, int log_idx);
+
+/* commits referring ticket in ascending log_idx, NULL if none */
+const std::vector<int> *ticket_index_lookup(const char *ticket);
+
+/* approximate memory usage of the index in bytes */
+size_t ticket_index_usage(void);
+
+/*
+ * feed the output of git log --format=%x1e%B, records are numbered from 0
+ * in the order of git log
+ */
+void ticket_stream_feed(const char *buf, size_t len);
+void ticket_stream_end(void);
+
+/* positions are changed by new commits, the index is built again */
+void ticket_index_clear(void);
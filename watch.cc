@@ -0,0 +1,124 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <dirent.h>
+#include <sys/inotify.h>
+
+#include <string>
+#include <unordered_map>
+
+#include "util.hh"
+#include "watch.hh"
+
+using namespace std;
+
+#define REFS_MASK (IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_DELETE \
+		   | IN_MOVED_FROM | IN_ONLYDIR)
+#define GIT_DIR_MASK (IN_CLOSE_WRITE | IN_MOVED_TO | IN_ONLYDIR)
+
+static int inotify_fd = -1;
+
+/* watch descriptor to its path, the git directories aren't recursive */
+static unordered_map<int, string> watched_dirs;
+static int git_dir_wd = -1, common_dir_wd = -1;
+
+static void watch_dir_recursive(const string &path)
+{
+  int wd = inotify_add_watch(inotify_fd, path.c_str(), REFS_MASK);
+  if (wd < 0)
+    return;
+
+  watched_dirs[wd] = path;
+
+  DIR *dir = opendir(path.c_str());
+  if (!dir)
+    return;
+
+  struct dirent *ent;
+  while ((ent = readdir(dir))) {
+    if (ent->d_type != DT_DIR || ent->d_name[0] == '.')
+      continue;
+
+    watch_dir_recursive(path + "/" + ent->d_name);
+  }
+
+  closedir(dir);
+}
+
+int watch_refs(const char *git_dir, const char *common_dir)
+{
+  inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (inotify_fd < 0)
+    return -1;
+
+  git_dir_wd = inotify_add_watch(inotify_fd, git_dir, GIT_DIR_MASK);
+  common_dir_wd = inotify_add_watch(inotify_fd, common_dir, GIT_DIR_MASK);
+
+  const char *refs[] = { "refs/heads", "refs/remotes", "refs/tags", NULL };
+  for (int i = 0; refs[i]; i++)
+    watch_dir_recursive(string(common_dir) + "/" + refs[i]);
+
+  return inotify_fd;
+}
+
+/* lock files are renamed to refs, only the results are interesting */
+static bool is_lock_file(const char *name)
+{
+  size_t len = strlen(name);
+
+  return 5 <= len && !strcmp(name + len - 5, ".lock");
+}
+
+static bool event_changes_refs(const struct inotify_event *ev)
+{
+  if (!ev->len || is_lock_file(ev->name))
+    return false;
+
+  if (ev->wd == git_dir_wd || ev->wd == common_dir_wd) {
+    /* other files like index are updated too often */
+    return !strcmp(ev->name, "HEAD") || !strcmp(ev->name, "packed-refs");
+  }
+
+  auto it = watched_dirs.find(ev->wd);
+  if (it == watched_dirs.end())
+    return false;
+
+  /* new directories, e.g. of a new remote */
+  if ((ev->mask & IN_CREATE) && (ev->mask & IN_ISDIR)) {
+    watch_dir_recursive(it->second + "/" + ev->name);
+    return false;
+  }
+
+  return !(ev->mask & IN_ISDIR);
+}
+
+bool watch_refs_changed(void)
+{
+  char buf[4096]
+    __attribute__ ((aligned(__alignof__(struct inotify_event))));
+  bool changed = false;
+
+  while (1) {
+    ssize_t len = read(inotify_fd, buf, sizeof(buf));
+    if (len < 0) {
+      if (errno == EINTR)
+	continue;
+      if (errno == EAGAIN)
+	break;
+
+      die("read() failed\n");
+    }
+
+    for (char *p = buf; p < buf + len; ) {
+      const struct inotify_event *ev =
+	reinterpret_cast<const struct inotify_event *>(p);
+
+      changed |= event_changes_refs(ev);
+      p += sizeof(struct inotify_event) + ev->len;
+    }
+  }
+
+  return changed;
+}
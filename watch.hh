@@ -0,0 +1,33 @@
+/*
+ * glg - a specialized pager for git log
+ *
+ * Copyright (C) 2012 - 2016 Hitoshi Mitake <mitake.hitoshi@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#pragma once
+
+/*
+ * watching HEAD and refs with inotify. loose refs under refs/heads,
+ * refs/remotes and refs/tags are watched recursively, packed-refs and HEAD
+ * in the git directories.
+ */
+
+/* watch_refs(): return an fd for poll(), -1 if inotify isn't available */
+int watch_refs(const char *git_dir, const char *common_dir);
+
+/* watch_refs_changed(): consume events, true if HEAD or a ref changed */
+bool watch_refs_changed(void);